@@ -0,0 +1,352 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#include "ui/emoji_config.h"
+#include "ui/emoji_matcher.h"
+#include "emoji_suggestions_helper.h"
+
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+
+#include <crl/crl_time.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <random>
+
+namespace {
+
+using namespace Ui::Emoji;
+
+constexpr auto kDefaultDuration = crl::time(300);
+constexpr auto kMinRuns = 3;
+constexpr auto kTextLength = 256 * 1024;
+constexpr auto kFuzzLength = 1024 * 1024;
+constexpr auto kReportMismatches = 16;
+
+using FindMethod = Fn<EmojiPtr(const QChar*, const QChar*, int*)>;
+
+[[nodiscard]] std::vector<EmojiPtr> AllEmoji() {
+	auto result = std::vector<EmojiPtr>();
+	for (auto i = 0, count = internal::FullCount(); i != count; ++i) {
+		if (const auto emoji = internal::ByIndex(i)) {
+			result.push_back(emoji);
+		}
+	}
+	return result;
+}
+
+[[nodiscard]] QString WithoutPostfixes(QString text) {
+	return text.remove(QChar(kPostfix));
+}
+
+// Emoji in all the spellings with random words, postfixes, joiners
+// and cut sequences between them.
+[[nodiscard]] QString FuzzText(const std::vector<EmojiPtr> &all) {
+	auto generator = std::mt19937(0x1E3D);
+	const auto noise = std::array<QChar, 10>{ {
+		QChar('a'),
+		QChar(' '),
+		QChar('1'),
+		QChar('#'),
+		QChar(0x0430),
+		QChar(0x200D),
+		QChar(kPostfix),
+		QChar(0x20E3),
+		QChar(0xD83D),
+		QChar(0xDFFB),
+	} };
+	auto result = QString();
+	result.reserve(kFuzzLength + 64);
+	while (result.size() < kFuzzLength) {
+		const auto emoji = all[generator() % all.size()];
+		switch (generator() % 6) {
+		case 0: result.append(emoji->id()); break;
+		case 1: result.append(emoji->text()); break;
+		case 2: result.append(WithoutPostfixes(emoji->text())); break;
+		case 3: {
+			const auto text = emoji->text();
+			result.append(text.mid(0, 1 + (generator() % text.size())));
+		} break;
+		case 4: {
+			auto text = emoji->text();
+			text.insert(generator() % (text.size() + 1), QChar(kPostfix));
+			result.append(text);
+		} break;
+		case 5: result.append(noise[generator() % noise.size()]); break;
+		}
+	}
+	return result;
+}
+
+[[nodiscard]] QString EmojiDenseText(const std::vector<EmojiPtr> &all) {
+	const auto words = std::array<QString, 4>{ {
+		"ok ",
+		"see you ",
+		"привет ",
+		"",
+	} };
+	auto generator = std::mt19937(0xE0);
+	auto result = QString();
+	while (result.size() < kTextLength) {
+		result.append(all[generator() % all.size()]->text());
+		result.append(words[generator() % words.size()]);
+	}
+	return result;
+}
+
+[[nodiscard]] QString PlainText(const QString &sample) {
+	auto result = QString();
+	while (result.size() < kTextLength) {
+		result.append(sample);
+	}
+	return result;
+}
+
+// Compares the results and lengths at every position of the text.
+[[nodiscard]] int Compare(
+		const Matcher &matcher,
+		const QString &text,
+		const char *name) {
+	auto mismatches = 0;
+	const auto till = text.constEnd();
+	for (auto ch = text.constBegin(); ch != till; ++ch) {
+		auto generatedLength = 0;
+		auto tableLength = 0;
+		const auto generated = internal::Find(ch, till, &generatedLength);
+		const auto table = matcher.find(ch, till, &tableLength);
+		if (generated == table
+			&& (!generated || generatedLength == tableLength)) {
+			continue;
+		} else if (++mismatches <= kReportMismatches) {
+			fprintf(
+				stderr,
+				"Mismatch in %s at %d: generated %d (%d), table %d (%d).\n",
+				name,
+				int(ch - text.constBegin()),
+				generated ? generated->index() : -1,
+				generatedLength,
+				table ? table->index() : -1,
+				tableLength);
+		}
+	}
+	return mismatches;
+}
+
+// Walks the text like the text parser does, returns ns per code unit.
+[[nodiscard]] double Measure(
+		const QString &text,
+		FindMethod method,
+		crl::time duration) {
+	auto elapsed = int64();
+	auto runs = 0;
+	auto timer = QElapsedTimer();
+	auto found = 0;
+	while (runs < kMinRuns || elapsed < duration * 1'000'000) {
+		const auto till = text.constEnd();
+		timer.start();
+		for (auto ch = text.constBegin(); ch != till;) {
+			auto length = 0;
+			if (method(ch, till, &length)) {
+				ch += length;
+				++found;
+			} else {
+				++ch;
+			}
+		}
+		elapsed += timer.nsecsElapsed();
+		++runs;
+	}
+	static volatile auto Sink = 0;
+	Sink = found;
+	return double(elapsed) / (double(runs) * text.size());
+}
+
+// Every prefix of every alpha code and alias, as typed after the colon.
+[[nodiscard]] std::vector<QString> SuggestionQueries(const QString &path) {
+	auto file = QFile(path);
+	if (!file.open(QIODevice::ReadOnly)) {
+		return {};
+	}
+	auto result = std::vector<QString>();
+	const auto document = QJsonDocument::fromJson(file.readAll());
+	for (const auto value : document.object()) {
+		const auto entry = value.toObject();
+		const auto codes = entry["alpha_code"].toString()
+			+ '|'
+			+ entry["aliases"].toString();
+		for (const auto &code : codes.split('|', Qt::SkipEmptyParts)) {
+			const auto word = code.mid(1, code.size() - 2);
+			for (auto length = 1; length <= word.size(); ++length) {
+				result.push_back(word.left(length));
+			}
+		}
+	}
+	return result;
+}
+
+// Returns call latencies in ns, sorted.
+[[nodiscard]] std::vector<int64> MeasureSuggestions(
+		const std::vector<QString> &queries) {
+	auto result = std::vector<int64>();
+	result.reserve(queries.size());
+	auto timer = QElapsedTimer();
+	auto found = size_t();
+	for (const auto &query : queries) {
+		const auto utf16 = QStringToUTF16(query);
+		timer.start();
+		found += GetSuggestions(utf16).size();
+		result.push_back(timer.nsecsElapsed());
+	}
+	static volatile auto Sink = size_t();
+	Sink = found;
+	std::sort(begin(result), end(result));
+	return result;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+	auto application = QCoreApplication(argc, argv);
+
+	auto parser = QCommandLineParser();
+	parser.setApplicationDescription(
+		"Checks and times the emoji matcher and suggestions, "
+		"prints the results as JSON.");
+	parser.addHelpOption();
+	const auto duration = QCommandLineOption(
+		"duration",
+		"Minimal measured time of each case, in ms.",
+		"ms",
+		QString::number(kDefaultDuration));
+	const auto output = QCommandLineOption(
+		"output",
+		"Write the results to the file.",
+		"path");
+	const auto autocomplete = QCommandLineOption(
+		"autocomplete",
+		"The emoji_autocomplete.json to take the suggestion queries from.",
+		"path",
+		LIB_UI_EMOJI_AUTOCOMPLETE_JSON);
+	parser.addOptions({ duration, output, autocomplete });
+	parser.process(application);
+	const auto measureDuration = crl::time(
+		std::max(parser.value(duration).toLongLong(), 1LL));
+
+	internal::Init();
+	const auto all = AllEmoji();
+
+	auto timer = QElapsedTimer();
+	timer.start();
+	auto matcher = Matcher();
+	matcher.fill();
+	const auto fillTime = timer.nsecsElapsed() / 1'000'000.;
+
+	// Every sequence in all the spellings, one by one.
+	auto mismatches = 0;
+	for (const auto emoji : all) {
+		for (const auto &text : {
+				emoji->id(),
+				emoji->text(),
+				WithoutPostfixes(emoji->text()) }) {
+			mismatches += Compare(matcher, text, "sequence");
+		}
+	}
+	mismatches += Compare(matcher, FuzzText(all), "fuzz");
+
+	const auto generated = FindMethod(internal::Find);
+	const auto table = FindMethod([&](
+			const QChar *start,
+			const QChar *end,
+			int *outLength) {
+		return matcher.find(start, end, outLength);
+	});
+	const auto texts = std::vector<std::pair<QString, QString>>{
+		{ "latin", PlainText("Lorem ipsum dolor sit amet, 12345. ") },
+		{ "cyrillic", PlainText("Съешь ещё этих булок, 12345. ") },
+		{ "emoji_dense", EmojiDenseText(all) },
+	};
+	auto results = QJsonArray();
+	for (const auto &[name, text] : texts) {
+		const auto before = Measure(text, generated, measureDuration);
+		const auto after = Measure(text, table, measureDuration);
+		fprintf(
+			stderr,
+			"%-12s generated %7.3f ns/char, table %7.3f ns/char\n",
+			name.toUtf8().constData(),
+			before,
+			after);
+		results.append(QJsonObject{
+			{ "name", name },
+			{ "generated_ns_per_char", before },
+			{ "table_ns_per_char", after },
+		});
+	}
+
+	// Each query once, like typing every code after the colon.
+	auto suggestions = QJsonObject();
+	const auto queries = SuggestionQueries(parser.value(autocomplete));
+	if (!queries.empty()) {
+		const auto latencies = MeasureSuggestions(queries);
+		const auto percentile = [&](int value) {
+			const auto index = (latencies.size() - 1) * value / 100;
+			return latencies[index] / 1000.;
+		};
+		auto total = int64();
+		for (const auto latency : latencies) {
+			total += latency;
+		}
+		const auto average = total / 1000. / latencies.size();
+		fprintf(
+			stderr,
+			"suggestions  %d queries, %.2f us average, %.2f us p50, "
+			"%.2f us p99, %.2f us max\n",
+			int(queries.size()),
+			average,
+			percentile(50),
+			percentile(99),
+			percentile(100));
+		suggestions = QJsonObject{
+			{ "queries", int(queries.size()) },
+			{ "average_us", average },
+			{ "p50_us", percentile(50) },
+			{ "p99_us", percentile(99) },
+			{ "max_us", percentile(100) },
+		};
+	} else {
+		fprintf(
+			stderr,
+			"Could not read queries from %s.\n",
+			qPrintable(parser.value(autocomplete)));
+	}
+
+	const auto json = QJsonDocument(QJsonObject{
+		{ "emoji", int(all.size()) },
+		{ "fill_ms", fillTime },
+		{ "mismatches", mismatches },
+		{ "results", results },
+		{ "suggestions", suggestions },
+	}).toJson();
+	if (parser.isSet(output)) {
+		auto file = QFile(parser.value(output));
+		if (!file.open(QIODevice::WriteOnly) || file.write(json) < 0) {
+			fprintf(
+				stderr,
+				"Could not write %s.\n",
+				qPrintable(file.fileName()));
+			return 2;
+		}
+	} else {
+		fwrite(json.constData(), 1, json.size(), stdout);
+	}
+	return mismatches ? 1 : 0;
+}
@@ -0,0 +1,697 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#include "ui/image/image_prepare.h"
+#include "ui/style/style_core.h"
+#include "base/flat_map.h"
+#include "styles/palette.h"
+
+#include <zlib.h>
+#include <QtCore/QBuffer>
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtGui/QGuiApplication>
+#include <QtGui/QImageWriter>
+
+#include <crl/crl_time.h>
+
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+
+// Counts the heap allocations made by all threads during a measured call.
+// With glibc malloc itself is interposed, so that the QImage pixel buffers
+// are counted too, otherwise only operator new is.
+namespace {
+
+std::atomic<int64> Allocations = 0;
+
+} // namespace
+
+#if defined __GLIBC__ && !defined Q_OS_WIN
+
+extern "C" {
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *pointer, size_t size);
+
+void *malloc(size_t size) noexcept {
+	Allocations.fetch_add(1, std::memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) noexcept {
+	Allocations.fetch_add(1, std::memory_order_relaxed);
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) noexcept {
+	Allocations.fetch_add(1, std::memory_order_relaxed);
+	return __libc_realloc(pointer, size);
+}
+
+} // extern "C"
+
+#else // __GLIBC__ && !Q_OS_WIN
+
+void *operator new(size_t size) {
+	Allocations.fetch_add(1, std::memory_order_relaxed);
+	if (const auto result = std::malloc(size ? size : 1)) {
+		return result;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept {
+	std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+	std::free(pointer);
+}
+
+#endif // __GLIBC__ && !Q_OS_WIN
+
+namespace {
+
+constexpr auto kDefaultDuration = crl::time(300);
+constexpr auto kDefaultThreshold = 10.;
+constexpr auto kMinCalls = 3;
+constexpr auto kSvgVariants = 64;
+constexpr auto kProgressiveChunk = 1024;
+
+const auto kSizes = std::array<QSize, 3>{ {
+	{ 320, 320 },
+	{ 1280, 720 },
+	{ 2560, 1440 },
+} };
+
+struct Result {
+	QString name;
+	QSize size;
+	int64 calls = 0;
+	double nsPerCall = 0.;
+	double nsPerPixel = 0.;
+	double allocationsPerCall = 0.;
+};
+
+struct Settings {
+	crl::time duration = kDefaultDuration;
+	QString filter;
+};
+
+volatile auto Sink = uint32();
+
+void Consume(const QImage &image) {
+	Sink = image.isNull()
+		? 0U
+		: *reinterpret_cast<const uint32*>(image.constBits());
+}
+
+// The input is made outside of the measured time, so that the methods
+// taking QImage&& get an image they can modify without a detach.
+[[nodiscard]] Result Measure(
+		const Settings &settings,
+		const QString &name,
+		QSize size,
+		Fn<QImage(int iteration)> input,
+		Fn<QImage(QImage &&image, int iteration)> method) {
+	Consume(method(input(0), 0));
+
+	auto result = Result{ .name = name, .size = size };
+	auto elapsed = int64();
+	auto allocations = int64();
+	auto timer = QElapsedTimer();
+	while (result.calls < kMinCalls
+		|| elapsed < settings.duration * 1'000'000) {
+		const auto iteration = int(++result.calls);
+		auto image = input(iteration);
+		const auto allocationsBefore = Allocations.load();
+		timer.start();
+		auto prepared = method(std::move(image), iteration);
+		elapsed += timer.nsecsElapsed();
+		allocations += Allocations.load() - allocationsBefore;
+		Consume(prepared);
+	}
+	result.nsPerCall = double(elapsed) / result.calls;
+	result.nsPerPixel = result.nsPerCall
+		/ std::max(int64(size.width()) * size.height(), int64(1));
+	result.allocationsPerCall = double(allocations) / result.calls;
+	return result;
+}
+
+[[nodiscard]] QImage Synthetic(QSize size, bool alpha) {
+	auto result = QImage(
+		size,
+		alpha ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+	const auto width = size.width();
+	const auto height = size.height();
+	for (auto y = 0; y != height; ++y) {
+		auto line = reinterpret_cast<uint32*>(result.scanLine(y));
+		for (auto x = 0; x != width; ++x) {
+			// Smooth gradients with a deterministic detail pattern on top.
+			const auto noise = ((uint32(x) * 73856093U)
+				^ (uint32(y) * 19349663U)) & 0x1FU;
+			const auto r = uint32(x * 223 / width) + noise;
+			const auto g = uint32(y * 223 / height) + (noise >> 1);
+			const auto b = uint32(((x + y) * 223) / (width + height)) + 16;
+			const auto a = alpha ? uint32(0x80 + (x * 0x7F / width)) : 0xFFU;
+			line[x] = (a << 24)
+				| ((r * a / 0xFF) << 16)
+				| ((g * a / 0xFF) << 8)
+				| (b * a / 0xFF);
+		}
+	}
+	return result;
+}
+
+[[nodiscard]] QByteArray Encode(const QImage &image, const char *format) {
+	auto result = QByteArray();
+	auto buffer = QBuffer(&result);
+	buffer.open(QIODevice::WriteOnly);
+	auto writer = QImageWriter(&buffer, format);
+	writer.setQuality(87);
+	return writer.write(image) ? result : QByteArray();
+}
+
+struct ProgressiveResult {
+	QImage image;
+	int scans = 0;
+	int finals = 0;
+};
+
+// Feeds the content in pieces, like it arrives from the network. The
+// reader is destroyed in the callback with the final image.
+[[nodiscard]] ProgressiveResult ReadProgressive(const QByteArray &content) {
+	auto result = ProgressiveResult();
+	auto reader = std::unique_ptr<Images::ProgressiveJpegReader>();
+	reader = std::make_unique<Images::ProgressiveJpegReader>([&](
+			QImage image,
+			bool final) {
+		++result.scans;
+		if (final) {
+			++result.finals;
+			result.image = std::move(image);
+			reader = nullptr;
+		}
+	});
+	for (auto offset = 0; reader && offset < content.size();) {
+		const auto piece = content.mid(offset, kProgressiveChunk);
+		offset += piece.size();
+		if (!reader->feed(piece)) {
+			return {};
+		}
+	}
+	return result;
+}
+
+[[nodiscard]] QByteArray PackGzip(const QByteArray &bytes) {
+	auto stream = z_stream();
+	if (deflateInit2(
+			&stream,
+			Z_BEST_COMPRESSION,
+			Z_DEFLATED,
+			16 + MAX_WBITS,
+			8,
+			Z_DEFAULT_STRATEGY) != Z_OK) {
+		return QByteArray();
+	}
+	auto result = QByteArray(
+		int(deflateBound(&stream, bytes.size())),
+		Qt::Uninitialized);
+	stream.next_in = reinterpret_cast<Bytef*>(
+		const_cast<char*>(bytes.constData()));
+	stream.avail_in = bytes.size();
+	stream.next_out = reinterpret_cast<Bytef*>(result.data());
+	stream.avail_out = result.size();
+	const auto status = deflate(&stream, Z_FINISH);
+	const auto size = int(stream.total_out);
+	deflateEnd(&stream);
+	return (status == Z_STREAM_END) ? result.left(size) : QByteArray();
+}
+
+// Each variant differs in a comment, so that the rasterized svg cache
+// in Images::Read() doesn't make the measured calls free.
+[[nodiscard]] QByteArray SyntheticSvg(QSize size, int variant) {
+	auto result = QString(
+		"<svg xmlns=\"http://www.w3.org/2000/svg\" "
+		"width=\"%1\" height=\"%2\" viewBox=\"0 0 100 100\">"
+		"<!-- %3 -->"
+		"<defs><linearGradient id=\"g\">"
+		"<stop offset=\"0\" stop-color=\"#40a7e3\"/>"
+		"<stop offset=\"1\" stop-color=\"#e3a740\"/>"
+		"</linearGradient></defs>"
+		"<rect width=\"100\" height=\"100\" fill=\"url(#g)\"/>"
+	).arg(size.width()).arg(size.height()).arg(variant);
+	for (auto i = 0; i != 32; ++i) {
+		result += QString(
+			"<path d=\"M%1 %2 q 20 -30 40 0 t 40 0\" stroke=\"#%3\" "
+			"stroke-width=\"2\" fill=\"none\"/>"
+		).arg(i * 3).arg(10 + (i * 37) % 80).arg(
+			uint((i * 0x2F1A3B) & 0xFFFFFF), 6, 16, QChar('0'));
+	}
+	result += "</svg>";
+	return PackGzip(result.toUtf8());
+}
+
+[[nodiscard]] QString SizeKey(const Result &result) {
+	return result.name
+		+ '@'
+		+ QString::number(result.size.width())
+		+ 'x'
+		+ QString::number(result.size.height());
+}
+
+class Suite final {
+public:
+	explicit Suite(Settings settings);
+
+	void runSynthetic();
+	void runSamples(const QString &folder);
+
+	[[nodiscard]] const std::vector<Result> &results() const;
+	[[nodiscard]] int failures() const;
+
+private:
+	void add(
+		const QString &name,
+		QSize size,
+		Fn<QImage(int iteration)> input,
+		Fn<QImage(QImage &&image, int iteration)> method);
+	void addRead(
+		const QString &name,
+		QSize size,
+		std::vector<QByteArray> variants,
+		bool gzipSvg);
+	void addProgressive(QSize size, QByteArray content);
+	void addProcessing(const QImage &opaque, const QImage &transparent);
+
+	const Settings _settings;
+	std::vector<Result> _results;
+	int _failures = 0;
+
+};
+
+Suite::Suite(Settings settings)
+: _settings(std::move(settings)) {
+}
+
+void Suite::add(
+		const QString &name,
+		QSize size,
+		Fn<QImage(int iteration)> input,
+		Fn<QImage(QImage &&image, int iteration)> method) {
+	if (!_settings.filter.isEmpty() && !name.contains(_settings.filter)) {
+		return;
+	}
+	_results.push_back(Measure(
+		_settings,
+		name,
+		size,
+		std::move(input),
+		std::move(method)));
+	const auto &result = _results.back();
+	fprintf(
+		stderr,
+		"%-32s %5dx%-5d %10.3f ns/pixel %8.1f allocations/call\n",
+		result.name.toUtf8().constData(),
+		result.size.width(),
+		result.size.height(),
+		result.nsPerPixel,
+		result.allocationsPerCall);
+}
+
+void Suite::addRead(
+		const QString &name,
+		QSize size,
+		std::vector<QByteArray> variants,
+		bool gzipSvg) {
+	if (variants.empty() || variants.front().isEmpty()) {
+		fprintf(stderr, "%s: not supported, skipped.\n", qPrintable(name));
+		return;
+	}
+	add(name, size, [](int) {
+		return QImage();
+	}, [=](QImage &&, int iteration) {
+		return Images::Read({
+			.content = variants[iteration % variants.size()],
+			.gzipSvg = gzipSvg,
+		}).image;
+	});
+}
+
+// Progressive JPEG arriving in pieces must give some refined images and
+// then exactly one final image of the full size.
+void Suite::addProgressive(QSize size, QByteArray content) {
+	const auto name = QString("read.jpeg_progressive_chunks");
+	if (!_settings.filter.isEmpty() && !name.contains(_settings.filter)) {
+		return;
+	} else if (content.isEmpty()) {
+		fprintf(stderr, "%s: not supported, skipped.\n", qPrintable(name));
+		return;
+	}
+	const auto check = ReadProgressive(content);
+	if (check.finals != 1 || check.scans < 2 || check.image.size() != size) {
+		fprintf(
+			stderr,
+			"%s: failed, %d images, %d final, %dx%d.\n",
+			qPrintable(name),
+			check.scans,
+			check.finals,
+			check.image.width(),
+			check.image.height());
+		++_failures;
+		return;
+	}
+	add(name, size, [](int) {
+		return QImage();
+	}, [=](QImage &&, int) {
+		return ReadProgressive(content).image;
+	});
+}
+
+void Suite::addProcessing(const QImage &opaque, const QImage &transparent) {
+	using namespace Images;
+
+	const auto size = opaque.size();
+	const auto copy = [](const QImage &image) {
+		return [=](int) {
+			auto result = image;
+			result.detach();
+			return result;
+		};
+	};
+	const auto thumbnail = size / 4;
+	const auto prepare = [&](const QString &name, PrepareArgs args) {
+		add("prepare." + name, size, copy(opaque), [=](QImage &&image, int) {
+			return Prepare(std::move(image), thumbnail, args);
+		});
+	};
+	prepare("scale", {});
+	prepare("scale_fast", { .options = Option::FastTransform });
+	prepare("blur", { .options = Option::Blur });
+	prepare("round_large", { .options = Option::RoundLarge });
+	prepare("circle", { .options = Option::RoundCircle });
+	prepare("colored", { .colored = &st::windowBgActive });
+	prepare("outer", {
+		.options = Option::RoundSmall,
+		.outer = thumbnail + QSize(16, 16),
+	});
+
+	add("blur", size, copy(opaque), [](QImage &&image, int) {
+		return Blur(std::move(image));
+	});
+	add("blur_large", size, copy(opaque), [](QImage &&image, int) {
+		return BlurLargeImage(std::move(image), 24);
+	});
+	add("round", size, copy(transparent), [](QImage &&image, int) {
+		return Round(std::move(image), ImageRoundRadius::Large);
+	});
+	add("circle", size, copy(transparent), [](QImage &&image, int) {
+		return Circle(std::move(image));
+	});
+	add("dither", size, copy(opaque), [](QImage &&image, int) {
+		return DitherImage(image);
+	});
+	add("colorize", size, copy(transparent), [](QImage &&image, int) {
+		return style::colorizeImage(image, QColor(0x40, 0xA7, 0xE3));
+	});
+	add("colored", size, copy(transparent), [](QImage &&image, int) {
+		return Colored(std::move(image), QColor(0x40, 0xA7, 0xE3, 0x80));
+	});
+	add("opaque", size, copy(transparent), [](QImage &&image, int) {
+		return Opaque(std::move(image));
+	});
+
+	const auto colors = std::vector<QColor>{
+		QColor(0xDB, 0xDD, 0xBB),
+		QColor(0x6B, 0xA5, 0x87),
+		QColor(0xD5, 0xD8, 0x8D),
+		QColor(0x88, 0xB8, 0x84),
+	};
+	// The colors are different in each call, so that the static
+	// gradients are generated and not taken from the cache.
+	const auto gradient = [&](const QString &name, int count, float progress) {
+		add("gradient." + name, size, [](int) {
+			return QImage();
+		}, [=](QImage &&, int iteration) {
+			auto list = std::vector<QColor>(
+				begin(colors),
+				begin(colors) + count);
+			for (auto &color : list) {
+				color = QColor(
+					(color.red() + iteration) % 256,
+					(color.green() + iteration / 256) % 256,
+					color.blue());
+			}
+			return GenerateGradient(size, list, 0, progress);
+		});
+	};
+	gradient("linear", 2, 1.f);
+	gradient("complex", 4, 1.f);
+
+	// Animation frames go through distinct progress values.
+	add("gradient.complex_animated", size, [](int) {
+		return QImage();
+	}, [=](QImage &&, int iteration) {
+		const auto progress = (iteration % 1000) / 1000.f;
+		return GenerateGradient(size, colors, 45, progress);
+	});
+}
+
+void Suite::runSynthetic() {
+	for (const auto size : kSizes) {
+		const auto opaque = Synthetic(size, false);
+		const auto transparent = Synthetic(size, true);
+
+		addRead("read.jpeg", size, { Encode(opaque, "jpeg") }, false);
+		addProgressive(
+			size,
+			Images::MakeProgressiveJpeg(Encode(opaque, "jpeg")));
+		addRead("read.png", size, { Encode(transparent, "png") }, false);
+		addRead("read.webp", size, { Encode(transparent, "webp") }, false);
+
+		auto svgs = std::vector<QByteArray>();
+		for (auto i = 0; i != kSvgVariants; ++i) {
+			svgs.push_back(SyntheticSvg(size, i));
+		}
+		addRead("read.svg_gz", size, std::move(svgs), true);
+
+		addProcessing(opaque, transparent);
+	}
+}
+
+void Suite::runSamples(const QString &folder) {
+	const auto files = QDir(folder).entryInfoList(
+		QDir::Files,
+		QDir::Name);
+	for (const auto &info : files) {
+		auto file = QFile(info.absoluteFilePath());
+		if (!file.open(QIODevice::ReadOnly)) {
+			continue;
+		}
+		const auto content = file.readAll();
+		const auto gzipSvg = info.fileName().endsWith(".svg.gz")
+			|| info.fileName().endsWith(".tgv");
+		const auto decoded = Images::Read({
+			.content = content,
+			.gzipSvg = gzipSvg,
+		}).image;
+		if (decoded.isNull()) {
+			fprintf(
+				stderr,
+				"%s: could not be read, skipped.\n",
+				qPrintable(info.fileName()));
+			continue;
+		}
+		const auto name = "sample." + info.fileName();
+		addRead(name + ".read", decoded.size(), { content }, gzipSvg);
+		const auto thumbnail = decoded.size() / 4;
+		add(name + ".prepare", decoded.size(), [=](int) {
+			auto result = decoded;
+			result.detach();
+			return result;
+		}, [=](QImage &&image, int) {
+			return Images::Prepare(std::move(image), thumbnail, {});
+		});
+	}
+}
+
+const std::vector<Result> &Suite::results() const {
+	return _results;
+}
+
+int Suite::failures() const {
+	return _failures;
+}
+
+[[nodiscard]] QJsonObject Serialize(const std::vector<Result> &results) {
+	auto list = QJsonArray();
+	for (const auto &result : results) {
+		list.append(QJsonObject{
+			{ "name", result.name },
+			{ "width", result.size.width() },
+			{ "height", result.size.height() },
+			{ "calls", double(result.calls) },
+			{ "ns_per_call", result.nsPerCall },
+			{ "ns_per_pixel", result.nsPerPixel },
+			{ "allocations_per_call", result.allocationsPerCall },
+		});
+	}
+	return QJsonObject{ { "results", list } };
+}
+
+[[nodiscard]] base::flat_map<QString, double> ReadBaseline(
+		const QString &path) {
+	auto file = QFile(path);
+	if (!file.open(QIODevice::ReadOnly)) {
+		return {};
+	}
+	auto result = base::flat_map<QString, double>();
+	const auto document = QJsonDocument::fromJson(file.readAll());
+	for (const auto value : document.object()["results"].toArray()) {
+		const auto object = value.toObject();
+		const auto key = SizeKey({
+			.name = object["name"].toString(),
+			.size = QSize(
+				object["width"].toInt(),
+				object["height"].toInt()),
+		});
+		result.emplace(key, object["ns_per_pixel"].toDouble());
+	}
+	return result;
+}
+
+// Adds the baseline values to the serialized results, returns the count
+// of the results that are slower than the baseline by more than threshold.
+int CompareWithBaseline(
+		QJsonObject &serialized,
+		const base::flat_map<QString, double> &baseline,
+		double threshold) {
+	auto regressions = 0;
+	auto list = serialized["results"].toArray();
+	for (auto i = 0; i != list.size(); ++i) {
+		auto object = list[i].toObject();
+		const auto key = SizeKey({
+			.name = object["name"].toString(),
+			.size = QSize(object["width"].toInt(), object["height"].toInt()),
+		});
+		const auto j = baseline.find(key);
+		if (j == end(baseline) || j->second <= 0.) {
+			continue;
+		}
+		const auto change = object["ns_per_pixel"].toDouble() / j->second;
+		object["baseline_ns_per_pixel"] = j->second;
+		object["change"] = change;
+		if (change > 1. + threshold / 100.) {
+			object["regression"] = true;
+			++regressions;
+			fprintf(
+				stderr,
+				"Regression: %s is %.1f%% slower than the baseline.\n",
+				qPrintable(key),
+				(change - 1.) * 100.);
+		}
+		list[i] = object;
+	}
+	serialized["results"] = list;
+	return regressions;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+	if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+		qputenv("QT_QPA_PLATFORM", "offscreen");
+	}
+	auto application = QGuiApplication(argc, argv);
+
+	auto parser = QCommandLineParser();
+	parser.setApplicationDescription(
+		"Times the image pipeline, prints the results as JSON.");
+	parser.addHelpOption();
+	const auto duration = QCommandLineOption(
+		"duration",
+		"Minimal measured time of each case, in ms.",
+		"ms",
+		QString::number(kDefaultDuration));
+	const auto filter = QCommandLineOption(
+		"filter",
+		"Run only the cases with the name containing the text.",
+		"text");
+	const auto samples = QCommandLineOption(
+		"samples",
+		"Also measure reading and preparing the files from the folder.",
+		"folder");
+	const auto output = QCommandLineOption(
+		"output",
+		"Write the results to the file, it can be used as a baseline.",
+		"path");
+	const auto baseline = QCommandLineOption(
+		"baseline",
+		"Compare with the results saved before, fail on regressions.",
+		"path");
+	const auto threshold = QCommandLineOption(
+		"threshold",
+		"Slowdown in ns/pixel reported as a regression, in percent.",
+		"percent",
+		QString::number(kDefaultThreshold));
+	parser.addOptions({
+		duration,
+		filter,
+		samples,
+		output,
+		baseline,
+		threshold,
+	});
+	parser.process(application);
+
+	style::SetDevicePixelRatio(1);
+	style::startManager(style::kScaleDefault);
+
+	auto suite = Suite({
+		.duration = crl::time(
+			std::max(parser.value(duration).toLongLong(), 1LL)),
+		.filter = parser.value(filter),
+	});
+	suite.runSynthetic();
+	if (parser.isSet(samples)) {
+		suite.runSamples(parser.value(samples));
+	}
+	style::stopManager();
+
+	auto serialized = Serialize(suite.results());
+	auto regressions = 0;
+	if (parser.isSet(baseline)) {
+		regressions = CompareWithBaseline(
+			serialized,
+			ReadBaseline(parser.value(baseline)),
+			parser.value(threshold).toDouble());
+	}
+	const auto json = QJsonDocument(serialized).toJson();
+	if (parser.isSet(output)) {
+		auto file = QFile(parser.value(output));
+		if (!file.open(QIODevice::WriteOnly) || file.write(json) < 0) {
+			fprintf(
+				stderr,
+				"Could not write %s.\n",
+				qPrintable(file.fileName()));
+			return 2;
+		}
+	} else {
+		fwrite(json.constData(), 1, json.size(), stdout);
+	}
+	return (regressions || suite.failures()) ? 1 : 0;
+}
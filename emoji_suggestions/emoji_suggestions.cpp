@@ -7,6 +7,10 @@
 #include "emoji_suggestions.h"
 
 #include <algorithm>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
 #include "emoji_suggestions_data.h"
 
 #ifndef Expects
@@ -104,6 +108,136 @@ bool IsLetterOrNumber(utf16char ch) {
 
 using Replacement = internal::Replacement;
 
+// Replacement indices of one initial replacements list grouped by
+// the first one and the first two characters of their words.
+class PrefixIndex {
+public:
+	explicit PrefixIndex(const std::vector<const Replacement*> &list);
+
+	// Replacements (indices in the list, in the list order) that could
+	// match a query of two or more characters.
+	std::vector<int> candidates(const utf16char *query, int size) const;
+
+private:
+	using Key = uint32_t;
+	struct Postings {
+		Key key = 0;
+		std::vector<int> replacements;
+	};
+
+	[[nodiscard]] static Key MakeKey(utf16char first, utf16char second);
+
+	// Sorted replacement indices having a word with this prefix.
+	[[nodiscard]] const std::vector<int> &postings(
+		utf16char first,
+		utf16char second) const;
+
+	std::vector<Postings> _postings;
+	std::vector<int> _empty;
+
+};
+
+std::vector<int> Unite(const std::vector<int> &a, const std::vector<int> &b) {
+	auto result = std::vector<int>();
+	result.reserve(a.size() + b.size());
+	std::set_union(
+		std::begin(a),
+		std::end(a),
+		std::begin(b),
+		std::end(b),
+		std::back_inserter(result));
+	return result;
+}
+
+std::vector<int> Intersect(
+		const std::vector<int> &a,
+		const std::vector<int> &b) {
+	auto result = std::vector<int>();
+	result.reserve(a.size() < b.size() ? a.size() : b.size());
+	std::set_intersection(
+		std::begin(a),
+		std::end(a),
+		std::begin(b),
+		std::end(b),
+		std::back_inserter(result));
+	return result;
+}
+
+PrefixIndex::PrefixIndex(const std::vector<const Replacement*> &list) {
+	auto pairs = std::vector<std::pair<Key, int>>();
+	for (auto i = 0, count = int(list.size()); i != count; ++i) {
+		for (const auto &word : list[i]->words) {
+			if (!word.size()) {
+				continue;
+			}
+			pairs.emplace_back(MakeKey(word[0], 0), i);
+			if (word.size() > 1) {
+				pairs.emplace_back(MakeKey(word[0], word[1]), i);
+			}
+		}
+	}
+	std::sort(std::begin(pairs), std::end(pairs));
+	pairs.erase(std::unique(std::begin(pairs), std::end(pairs)), std::end(pairs));
+	for (const auto &[key, replacement] : pairs) {
+		if (_postings.empty() || _postings.back().key != key) {
+			_postings.push_back({ key });
+		}
+		_postings.back().replacements.push_back(replacement);
+	}
+}
+
+PrefixIndex::Key PrefixIndex::MakeKey(utf16char first, utf16char second) {
+	return (Key(first) << 16) | Key(second);
+}
+
+const std::vector<int> &PrefixIndex::postings(
+		utf16char first,
+		utf16char second) const {
+	const auto key = MakeKey(first, second);
+	const auto i = std::lower_bound(
+		std::begin(_postings),
+		std::end(_postings),
+		key,
+		[](const Postings &postings, Key key) { return postings.key < key; });
+	return (i != std::end(_postings) && i->key == key)
+		? i->replacements
+		: _empty;
+}
+
+std::vector<int> PrefixIndex::candidates(
+		const utf16char *query,
+		int size) const {
+	Expects(size > 1);
+
+	// A query tail starting at some position is matched either by a word
+	// starting with its first two characters or by a word starting with
+	// its first character followed by a match of the shorter tail.
+	auto result = postings(query[size - 1], 0);
+	for (auto position = size - 2; position >= 0; --position) {
+		const auto ch = query[position];
+		result = Unite(
+			postings(ch, query[position + 1]),
+			Intersect(postings(ch, 0), result));
+	}
+	return result;
+}
+
+const PrefixIndex &LookupPrefixIndex(
+		const std::vector<const Replacement*> *list) {
+	static auto Mutex = std::mutex();
+	static auto Indices = std::map<
+		const std::vector<const Replacement*>*,
+		std::unique_ptr<PrefixIndex>>();
+
+	// Indices are never changed or removed after they're created.
+	const auto lock = std::lock_guard<std::mutex>(Mutex);
+	auto &result = Indices[list];
+	if (!result) {
+		result = std::make_unique<PrefixIndex>(*list);
+	}
+	return *result;
+}
+
 class Completer {
 public:
 	Completer(utf16string query);
@@ -287,8 +421,12 @@ void Completer::initWordsTracking() {
 }
 
 void Completer::filterInitialList() {
+	Expects(_querySize > 1);
+
 	initWordsTracking();
-	for (auto item : *_initialList) {
+	const auto &index = LookupPrefixIndex(_initialList);
+	for (const auto position : index.candidates(_queryBegin, _querySize)) {
+		const auto item = (*_initialList)[position];
 		_currentItemWords = string_span(item->words);
 		_currentItemWordsUsedCount = 1;
 		if (matchQueryForCurrentItem()) {
@@ -7,11 +7,13 @@
 #include "emoji_config.h"
 
 #include "emoji_suggestions_helper.h"
+#include "ui/emoji_matcher.h"
 #include "base/bytes.h"
-#include "base/openssl_help.h"
+#include "base/options.h"
 #include "base/parse_helper.h"
 #include "base/debug_log.h"
 #include "ui/style/style_core.h"
+#include "ui/image/image_prepare.h"
 #include "ui/painter.h"
 #include "ui/ui_utility.h"
 #include "styles/style_basic.h"
@@ -19,9 +21,16 @@
 #include <QtCore/QJsonDocument>
 #include <QtCore/QJsonObject>
 #include <QtCore/QFile>
+#include <QtCore/QSaveFile>
 #include <QtCore/QDir>
 
 #include <crl/crl_async.h>
+#include <crl/crl_semaphore.h>
+#include <xxhash.h>
+
+#include <atomic>
+#include <list>
+#include <thread>
 
 namespace Ui {
 namespace Emoji {
@@ -31,8 +40,14 @@ constexpr auto kUniversalSize = 72;
 constexpr auto kImagesPerRow = 32;
 constexpr auto kImageRowsPerSprite = 16;
 
+constexpr auto kSinglePixmapsBudget = 4 * 1024 * 1024;
+constexpr auto kSinglePixmapsPrefillChunk = 16;
+constexpr auto kDefaultTileCacheBudget = int64(4 * 1024 * 1024);
+constexpr auto kCacheHeaderSize = qint64(4 * sizeof(uint32));
+constexpr auto kCacheChecksumSize = qint64(sizeof(uint64));
+
 constexpr auto kSetVersion = uint32(4);
-constexpr auto kCacheVersion = uint32(7);
+constexpr auto kCacheVersion = uint32(8);
 constexpr auto kMaxId = uint32(1 << 8);
 
 #ifdef Q_OS_MAC
@@ -45,33 +60,74 @@ enum class ConfigResult {
 	Good,
 };
 
+// Single emoji of one size read on demand from the sprite cache files,
+// least recently used ones are overwritten when the budget is exhausted.
+class TileAtlas final {
+public:
+	TileAtlas(int size, int64 budget);
+
+	struct Tile {
+		not_null<QImage*> page;
+		QRect rect;
+		bool filled = false;
+	};
+	[[nodiscard]] Tile lookup(int index);
+	void remove(int index);
+	void clear();
+
+private:
+	static constexpr auto kColumns = 32;
+	static constexpr auto kRowsPerPage = 8;
+	static constexpr auto kSlotsPerPage = kColumns * kRowsPerPage;
+
+	[[nodiscard]] Tile tile(int slot, bool filled);
+
+	const int _size = 0;
+	const int _slotsCount = 0;
+	std::vector<QImage> _pages;
+	std::vector<int> _slotIndices;
+	base::flat_map<int, int> _slots;
+	std::list<int> _lru;
+	std::vector<std::list<int>::iterator> _lruPositions;
+
+};
+
 // Right now we can't allow users of Ui::Emoji to create custom sizes.
 // Any Instance::Instance() can invalidate Universal.id() and sprites.
 // So all Instance::Instance() should happen before async generations.
 class Instance {
 public:
-	explicit Instance(int size);
+	Instance(int size, int64 tileCacheBudget);
 
 	bool cached() const;
 	void draw(QPainter &p, EmojiPtr emoji, int x, int y);
 
 private:
+	[[nodiscard]] bool spriteReady(int index) const;
 	void readCache();
 	void generateCache();
+	void applyGenerated();
 	void checkUniversalImages();
-	void pushSprite(QImage &&data);
+	[[nodiscard]] bool drawTile(QPainter &p, EmojiPtr emoji, int x, int y);
+	[[nodiscard]] bool fillTile(EmojiPtr emoji, const TileAtlas::Tile &tile);
 
 	int _id = 0;
 	int _size = 0;
-	std::vector<QPixmap> _sprites;
-	base::binary_guard _generating;
+	std::vector<QImage> _sprites;
+	std::unique_ptr<TileAtlas> _tiles;
+	std::vector<bool> _inFiles; // Sprites the tiles are read from.
+	std::vector<base::binary_guard> _generating; // For each sprite.
+	base::flat_map<int, QImage> _generated; // Waiting for previous ones.
 	bool _unsupported = false;
 
 };
 
+auto TableMatcher = Matcher();
+
 auto SizeNormal = -1;
 auto SizeLarge = -1;
 auto SpritesCount = -1;
+auto TileCacheBudget = int64(0);
 
 auto InstanceNormal = std::unique_ptr<Instance>();
 auto InstanceLarge = std::unique_ptr<Instance>();
@@ -86,8 +142,134 @@ auto TouchbarInstance = std::unique_ptr<Instance>();
 auto TouchbarEmoji = (Instance*)nullptr;
 #endif
 
-auto MainEmojiMap = std::map<int, QPixmap>();
-auto OtherEmojiMap = base::flat_map<int, std::map<int, QPixmap>>();
+base::options::toggle EmojiTileCacheOption({
+	.id = kOptionEmojiTileCache,
+	.name = "Emoji tile cache",
+	.description = "Keep only the recently drawn emoji in memory"
+		" and read the others from the cache on disk when needed.",
+	.restartRequired = true,
+});
+
+struct SinglePixmapEntry {
+	QPixmap pixmap;
+	std::list<uint64>::iterator position;
+};
+
+auto SinglePixmaps = base::flat_map<uint64, SinglePixmapEntry>();
+auto SinglePixmapsLru = std::list<uint64>(); // Most recent first.
+auto SinglePixmapsBudget = int64(kSinglePixmapsBudget);
+auto SinglePixmapsStats = SinglePixmapCacheStats();
+auto SinglePixmapsGeneration = 0;
+
+struct SpritesDecoding {
+	std::vector<QString> paths;
+	std::vector<QImage> images;
+	std::atomic<int> next = 0;
+	std::atomic<int> left = 0;
+	crl::semaphore done;
+};
+
+[[nodiscard]] uint64 SinglePixmapKey(EmojiPtr emoji, int fontHeight) {
+	return (uint64(uint32(fontHeight)) << 32) | uint64(uint32(emoji->index()));
+}
+
+[[nodiscard]] int64 SinglePixmapBytes(const QPixmap &pixmap) {
+	return int64(pixmap.width()) * pixmap.height() * 4;
+}
+
+void ClearSinglePixmaps() {
+	SinglePixmaps.clear();
+	SinglePixmapsLru.clear();
+	SinglePixmapsStats.bytes = 0;
+	SinglePixmapsStats.count = 0;
+	++SinglePixmapsGeneration;
+}
+
+void EvictSinglePixmaps(int64 budget) {
+	while (SinglePixmapsStats.bytes > budget && !SinglePixmapsLru.empty()) {
+		const auto i = SinglePixmaps.find(SinglePixmapsLru.back());
+		Assert(i != end(SinglePixmaps));
+
+		SinglePixmapsStats.bytes -= SinglePixmapBytes(i->second.pixmap);
+		--SinglePixmapsStats.count;
+		++SinglePixmapsStats.evictions;
+		SinglePixmaps.erase(i);
+		SinglePixmapsLru.pop_back();
+	}
+}
+
+void InsertSinglePixmap(uint64 key, const QPixmap &pixmap) {
+	SinglePixmapsLru.push_front(key);
+	SinglePixmaps.emplace(key, SinglePixmapEntry{
+		.pixmap = pixmap,
+		.position = begin(SinglePixmapsLru),
+	});
+	SinglePixmapsStats.bytes += SinglePixmapBytes(pixmap);
+	++SinglePixmapsStats.count;
+
+	// Always keep the one we've just added.
+	EvictSinglePixmaps(std::max(
+		SinglePixmapsBudget,
+		SinglePixmapBytes(pixmap)));
+}
+
+[[nodiscard]] QPixmap PrepareSinglePixmap(EmojiPtr emoji, int fontHeight) {
+	const auto factor = style::DevicePixelRatio();
+	auto image = QImage(
+		SizeNormal + st::emojiPadding * factor * 2,
+		fontHeight,
+		QImage::Format_ARGB32_Premultiplied);
+	image.setDevicePixelRatio(factor);
+	image.fill(Qt::transparent);
+	{
+		QPainter p(&image);
+		PainterHighQualityEnabler hq(p);
+		Draw(
+			p,
+			emoji,
+			SizeNormal,
+			st::emojiPadding,
+			(fontHeight - SizeNormal) / (2 * factor));
+	}
+	return PixmapFromImage(std::move(image));
+}
+
+void PrefillSinglePixmapsFrom(
+		std::vector<EmojiPtr> list,
+		int fontHeight,
+		int from,
+		int generation) {
+	crl::on_main([=, list = std::move(list)]() mutable {
+		if (generation != SinglePixmapsGeneration) {
+			return;
+		}
+		const auto factor = style::DevicePixelRatio();
+		const auto bytes = int64(SizeNormal + st::emojiPadding * factor * 2)
+			* fontHeight
+			* 4;
+		const auto till = std::min(
+			from + kSinglePixmapsPrefillChunk,
+			int(list.size()));
+		for (auto i = from; i != till; ++i) {
+			const auto emoji = list[i];
+			const auto key = SinglePixmapKey(emoji, fontHeight);
+			if (SinglePixmaps.contains(key)) {
+				continue;
+			} else if (SinglePixmapsStats.bytes + bytes > SinglePixmapsBudget) {
+				// Prefill never evicts what was really used.
+				return;
+			}
+			InsertSinglePixmap(key, PrepareSinglePixmap(emoji, fontHeight));
+		}
+		if (till < list.size()) {
+			PrefillSinglePixmapsFrom(
+				std::move(list),
+				fontHeight,
+				till,
+				generation);
+		}
+	});
+}
 
 int RowsCount(int index) {
 	if (index + 1 < SpritesCount) {
@@ -147,8 +329,7 @@ int ReadCurrentSetId() {
 void ApplyUniversalImages(std::shared_ptr<UniversalImages> images) {
 	Universal = std::move(images);
 	CanClearUniversal = false;
-	MainEmojiMap.clear();
-	OtherEmojiMap.clear();
+	ClearSinglePixmaps();
 	Updates.fire({});
 }
 
@@ -210,10 +391,30 @@ void ClearCurrentSetIdSync() {
 	WaitingToSwitchBackToId = id;
 }
 
+// Checksum of the header and of the middle pixel row of each emoji row,
+// so that the cache files are checked without reading them entirely.
+[[nodiscard]] uint64 CacheChecksum(
+		const uint32 (&header)[4],
+		int size,
+		Fn<const uchar*(int y)> line) {
+	const auto width = int(header[2]) * 4;
+	auto sample = QByteArray(
+		reinterpret_cast<const char*>(header),
+		sizeof(header));
+	for (auto y = size / 2; y < int(header[3]); y += size) {
+		sample.append(reinterpret_cast<const char*>(line(y)), width);
+	}
+	return XXH64(sample.constData(), sample.size(), 0);
+}
+
 void SaveToFile(int id, const QImage &image, int size, int index) {
 	Expects(image.bytesPerLine() == image.width() * 4);
 
-	QFile f(CacheFilePath(size, index));
+	// QSaveFile writes a temporary file and renames it on commit, so a file
+	// is never left half written. The file can't be replaced on Windows
+	// while it is mapped by LoadFromFile, but the sprites are generated
+	// only after the mapped ones of the instance are dropped.
+	QSaveFile f(CacheFilePath(size, index));
 	if (!f.open(QIODevice::WriteOnly)) {
 		if (!QDir::current().mkpath(internal::CacheFileFolder())
 			|| !f.open(QIODevice::WriteOnly)) {
@@ -239,98 +440,184 @@ void SaveToFile(int id, const QImage &image, int size, int index) {
 	const auto data = bytes::const_span(
 		reinterpret_cast<const bytes::type*>(image.bits()),
 		image.width() * image.height() * 4);
+	const uint64 checksum[] = {
+		CacheChecksum(header, size, [&](int y) {
+			return image.constScanLine(y);
+		}),
+	};
 	if (!write(bytes::make_span(header))
 		|| !write(data)
-		|| !write(openssl::Sha256(bytes::make_span(header), data))
-		|| false) {
+		|| !write(bytes::make_span(checksum))
+		|| !f.commit()) {
 		LOG(("App Error: Could not write emoji cache '%1' for size %2"
 			).arg(f.fileName()
 			).arg(size));
 	}
 }
 
-QImage LoadFromFile(int id, int size, int index) {
-	const auto rows = RowsCount(index);
+// Opens the cache file if it has the right size and header.
+[[nodiscard]] std::unique_ptr<QFile> OpenCacheFile(
+		int id,
+		int size,
+		int index) {
 	const auto width = kImagesPerRow * size;
-	const auto height = rows * size;
-	const auto fileSize = 4 * sizeof(uint32)
-		+ (width * height * 4)
-		+ openssl::kSha256Size;
-	QFile f(CacheFilePath(size, index));
-	if (!f.exists()
-		|| f.size() != fileSize
-		|| !f.open(QIODevice::ReadOnly)) {
-		return QImage();
+	const auto height = RowsCount(index) * size;
+	const auto fileSize = kCacheHeaderSize
+		+ qint64(width) * height * 4
+		+ kCacheChecksumSize;
+	auto result = std::make_unique<QFile>(CacheFilePath(size, index));
+	if (result->size() != fileSize || !result->open(QIODevice::ReadOnly)) {
+		return nullptr;
 	}
-	const auto read = [&](bytes::span data) {
-		return f.read(
-			reinterpret_cast<char*>(data.data()),
-			data.size()
-		) == data.size();
-	};
 	uint32 header[4] = { 0 };
-	if (!read(bytes::make_span(header))
+	const auto read = result->read(
+		reinterpret_cast<char*>(header),
+		sizeof(header));
+	if (read != sizeof(header)
 		|| header[0] != ComputeVersion(id)
 		|| header[1] != size
 		|| header[2] != width
 		|| header[3] != height) {
+		return nullptr;
+	}
+	return result;
+}
+
+// The files are checked once, when they are opened on startup.
+[[nodiscard]] std::unique_ptr<QFile> OpenCheckedCacheFile(
+		int id,
+		int size,
+		int index) {
+	auto result = OpenCacheFile(id, size, index);
+	if (!result) {
+		return nullptr;
+	}
+	const uint32 header[] = {
+		uint32(ComputeVersion(id)),
+		uint32(size),
+		uint32(kImagesPerRow * size),
+		uint32(RowsCount(index) * size),
+	};
+	const auto dataSize = qint64(header[2]) * header[3] * 4;
+	auto line = QByteArray(header[2] * 4, Qt::Uninitialized);
+	auto failed = false;
+	const auto checksum = CacheChecksum(header, size, [&](int y) {
+		const auto offset = kCacheHeaderSize + qint64(y) * line.size();
+		if (!result->seek(offset)
+			|| result->read(line.data(), line.size()) != line.size()) {
+			failed = true;
+		}
+		return reinterpret_cast<const uchar*>(line.constData());
+	});
+	auto stored = uint64();
+	if (failed
+		|| !result->seek(kCacheHeaderSize + dataSize)
+		|| result->read(
+			reinterpret_cast<char*>(&stored),
+			sizeof(stored)) != sizeof(stored)
+		|| stored != checksum) {
+		return nullptr;
+	}
+	return result;
+}
+
+// Reads the rows of a single emoji to the page, without the sprite.
+[[nodiscard]] bool ReadFromFile(
+		int id,
+		int size,
+		EmojiPtr emoji,
+		not_null<QImage*> page,
+		QPoint position) {
+	const auto file = OpenCacheFile(id, size, emoji->sprite());
+	if (!file) {
+		return false;
+	}
+	const auto line = qint64(kImagesPerRow) * size * 4;
+	const auto from = kCacheHeaderSize
+		+ emoji->row() * size * line
+		+ emoji->column() * size * 4;
+	for (auto y = 0; y != size; ++y) {
+		const auto to = page->scanLine(position.y() + y)
+			+ position.x() * 4;
+		if (!file->seek(from + y * line)
+			|| file->read(reinterpret_cast<char*>(to), size * 4) != size * 4) {
+			return false;
+		}
+	}
+	return true;
+}
+
+QImage LoadFromFile(int id, int size, int index) {
+	auto mapped = OpenCheckedCacheFile(id, size, index);
+	if (!mapped) {
 		return QImage();
 	}
-	auto result = QImage(
-		width,
-		height,
-		QImage::Format_ARGB32_Premultiplied);
-	Assert(result.bytesPerLine() == width * 4);
-	const auto data = bytes::make_span(
-		reinterpret_cast<bytes::type*>(result.bits()),
-		width * height * 4);
-	auto signature = bytes::vector(openssl::kSha256Size);
-	if (!read(data)
-		|| !read(signature)
-		//|| (bytes::compare(
-		//	signature,
-		//	openssl::Sha256(bytes::make_span(header), data)) != 0)
-		|| false) {
+	const auto mappedData = mapped->map(0, mapped->size());
+	if (!mappedData) {
 		return QImage();
 	}
 
-	// This should remove a non necessary detach on Retina screens later.
-	result.setDevicePixelRatio(style::DevicePixelRatio());
-
-	crl::async([=, signature = std::move(signature)] {
-		// This should not happen (invalid signature),
-		// so we delay this check and fix only the next launch.
-		const auto data = bytes::make_span(
-			reinterpret_cast<const bytes::type*>(result.bits()),
-			width * height * 4);
-		const auto result = bytes::compare(
-			signature,
-			openssl::Sha256(bytes::make_span(header), data));
-		if (result != 0) {
-			QFile(CacheFilePath(size, index)).remove();
+	// The image wraps the read-only mapped pages directly, so the sprite
+	// is paged in only when it is drawn, the checksum reads a few rows.
+	// The file is closed and unmapped when the last copy of the image is
+	// destroyed.
+	const auto width = kImagesPerRow * size;
+	return QImage(
+		static_cast<const uchar*>(mappedData + kCacheHeaderSize),
+		width,
+		RowsCount(index) * size,
+		width * 4,
+		QImage::Format_ARGB32_Premultiplied,
+		[](void *file) { delete static_cast<QFile*>(file); },
+		mapped.release());
+}
+
+void DecodeSprites(const std::shared_ptr<SpritesDecoding> &decoding) {
+	const auto count = int(decoding->paths.size());
+	while (true) {
+		const auto index = decoding->next++;
+		if (index >= count) {
+			return;
 		}
-	});
-	return result;
+		decoding->images[index] = QImage(
+			decoding->paths[index],
+			"WEBP"
+		).convertToFormat(QImage::Format_ARGB32_Premultiplied);
+		if (--decoding->left == 0) {
+			decoding->done.release();
+		}
+	}
 }
 
 std::vector<QImage> LoadSprites(int id) {
 	Expects(IsValidSetId(id));
 	Expects(SpritesCount > 0);
 
-	auto result = std::vector<QImage>();
 	const auto folder = (id != 0)
 		? internal::SetDataPath(id) + '/'
 		: QStringLiteral(":/gui/emoji/");
 	const auto base = folder + "emoji_";
-	return ranges::views::ints(
+	const auto decoding = std::make_shared<SpritesDecoding>();
+	decoding->paths = ranges::views::ints(
 		0,
 		SpritesCount
 	) | ranges::views::transform([&](int index) {
 		return base + QString::number(index + 1) + ".webp";
-	}) | ranges::views::transform([](const QString &path) {
-		return QImage(path, "WEBP").convertToFormat(
-			QImage::Format_ARGB32_Premultiplied);
 	}) | ranges::to_vector;
+	decoding->images.resize(SpritesCount);
+	decoding->left = SpritesCount;
+
+	// The calling thread decodes as well and only waits for the sprites
+	// already taken by the workers, so it is fine to call this from
+	// a crl::async() job even if the other workers are all busy.
+	const auto threads = int(std::thread::hardware_concurrency());
+	const auto helpers = std::min(SpritesCount, std::max(threads, 1)) - 1;
+	for (auto i = 0; i != helpers; ++i) {
+		crl::async([=] { DecodeSprites(decoding); });
+	}
+	DecodeSprites(decoding);
+	decoding->done.acquire();
+	return std::move(decoding->images);
 }
 
 std::vector<QImage> LoadAndValidateSprites(int id) {
@@ -421,22 +708,24 @@ void UniversalImages::draw(
 
 	const auto large = kUniversalSize;
 	const auto &original = _sprites[emoji->sprite()];
-	const auto data = original.bits();
-	const auto stride = original.bytesPerLine();
-	const auto format = original.format();
 	const auto row = emoji->row();
 	const auto column = emoji->column();
-	auto single = QImage(
-		data + (row * kImagesPerRow * large + column) * large * 4,
-		large,
-		large,
-		stride,
-		format
-	).scaled(
-		size,
-		size,
-		Qt::IgnoreAspectRatio,
-		Qt::SmoothTransformation);
+	auto single = !(large % size)
+		? Images::ScaleDownByRatio(
+			original,
+			large / size,
+			QRect(column * large, row * large, large, large))
+		: QImage(
+			original.bits() + (row * kImagesPerRow * large + column) * large * 4,
+			large,
+			large,
+			original.bytesPerLine(),
+			original.format()
+		).scaled(
+			size,
+			size,
+			Qt::IgnoreAspectRatio,
+			Qt::SmoothTransformation);
 	single.setDevicePixelRatio(p.device()->devicePixelRatio());
 	p.drawImage(x, y, single);
 }
@@ -448,6 +737,13 @@ QImage UniversalImages::generate(int size, int index) const {
 	const auto rows = RowsCount(index);
 	const auto large = kUniversalSize;
 	const auto &original = _sprites[index];
+	if (!(large % size)) {
+		// Integer ratios are averaged for the whole sprite at once.
+		auto result = Images::ScaleDownByRatio(original, large / size);
+		Assert(result.size() == QSize(size * kImagesPerRow, size * rows));
+		SaveToFile(_id, result, size, index);
+		return result;
+	}
 	const auto data = original.bits();
 	const auto stride = original.bytesPerLine();
 	const auto format = original.format();
@@ -482,8 +778,17 @@ QImage UniversalImages::generate(int size, int index) const {
 	return result;
 }
 
+const char kOptionEmojiTileCache[] = "emoji-tile-cache";
+
+void SetTileCacheBudget(int64 bytes) {
+	Expects(SpritesCount < 0);
+
+	TileCacheBudget = bytes;
+}
+
 void Init() {
 	internal::Init();
+	TableMatcher.fill();
 
 	const auto count = internal::FullCount();
 	const auto persprite = kImagesPerRow * kImageRowsPerSprite;
@@ -494,14 +799,21 @@ void Init() {
 	Universal = std::make_shared<UniversalImages>(ReadCurrentSetId());
 	CanClearUniversal = false;
 
-	InstanceNormal = std::make_unique<Instance>(SizeNormal);
-	InstanceLarge = std::make_unique<Instance>(SizeLarge);
+	const auto tileCacheBudget = ((TileCacheBudget > 0)
+		? TileCacheBudget
+		: EmojiTileCacheOption.value()
+		? kDefaultTileCacheBudget
+		: 0) / 2;
+	InstanceNormal = std::make_unique<Instance>(SizeNormal, tileCacheBudget);
+	InstanceLarge = std::make_unique<Instance>(SizeLarge, tileCacheBudget);
 
 #ifdef Q_OS_MAC
 	if (style::Scale() != kScaleForTouchBar) {
 		TouchbarSize = int(style::ConvertScale(18 * 4 / 3.,
 			kScaleForTouchBar * style::DevicePixelRatio()));
-		TouchbarInstance = std::make_unique<Instance>(TouchbarSize);
+		TouchbarInstance = std::make_unique<Instance>(
+			TouchbarSize,
+			tileCacheBudget);
 		TouchbarEmoji = TouchbarInstance.get();
 	} else {
 		TouchbarEmoji = InstanceLarge.get();
@@ -509,9 +821,14 @@ void Init() {
 #endif
 }
 
+EmojiPtr Find(const QChar *start, const QChar *end, int *outLength) {
+	return TableMatcher.empty()
+		? internal::Find(start, end, outLength)
+		: TableMatcher.find(start, end, outLength);
+}
+
 void Clear() {
-	MainEmojiMap.clear();
-	OtherEmojiMap.clear();
+	ClearSinglePixmaps();
 
 	InstanceNormal = nullptr;
 	InstanceLarge = nullptr;
@@ -731,35 +1048,37 @@ QVector<EmojiPtr> GetDefaultRecent() {
 	return result;
 }
 
-const QPixmap &SinglePixmap(EmojiPtr emoji, int fontHeight) {
-	const auto factor = style::DevicePixelRatio();
-	auto &map = (fontHeight == st::normalFont->height * factor)
-		? MainEmojiMap
-		: OtherEmojiMap[fontHeight];
-	auto i = map.find(emoji->index());
-	if (i != end(map)) {
-		return i->second;
-	}
-	auto image = QImage(
-		SizeNormal + st::emojiPadding * factor * 2,
+void SetSinglePixmapCacheBudget(int64 bytes) {
+	SinglePixmapsBudget = bytes;
+	EvictSinglePixmaps(SinglePixmapsBudget);
+}
+
+SinglePixmapCacheStats SinglePixmapCacheStatistics() {
+	return SinglePixmapsStats;
+}
+
+void PrefillSinglePixmaps(std::vector<EmojiPtr> list, int fontHeight) {
+	PrefillSinglePixmapsFrom(
+		std::move(list),
 		fontHeight,
-		QImage::Format_ARGB32_Premultiplied);
-	image.setDevicePixelRatio(factor);
-	image.fill(Qt::transparent);
-	{
-		QPainter p(&image);
-		PainterHighQualityEnabler hq(p);
-		Draw(
-			p,
-			emoji,
-			SizeNormal,
-			st::emojiPadding,
-			(fontHeight - SizeNormal) / (2 * factor));
+		0,
+		SinglePixmapsGeneration);
+}
+
+QPixmap SinglePixmap(EmojiPtr emoji, int fontHeight) {
+	const auto key = SinglePixmapKey(emoji, fontHeight);
+	if (const auto i = SinglePixmaps.find(key); i != end(SinglePixmaps)) {
+		++SinglePixmapsStats.hits;
+		SinglePixmapsLru.splice(
+			begin(SinglePixmapsLru),
+			SinglePixmapsLru,
+			i->second.position);
+		return i->second.pixmap;
 	}
-	return map.emplace(
-		emoji->index(),
-		PixmapFromImage(std::move(image))
-	).first->second;
+	++SinglePixmapsStats.misses;
+	auto result = PrepareSinglePixmap(emoji, fontHeight);
+	InsertSinglePixmap(key, result);
+	return result;
 }
 
 void Draw(QPainter &p, EmojiPtr emoji, int size, int x, int y) {
@@ -781,7 +1100,84 @@ void Draw(QPainter &p, EmojiPtr emoji, int size, int x, int y) {
 	}
 }
 
-Instance::Instance(int size) : _id(Universal->id()), _size(size) {
+TileAtlas::TileAtlas(int size, int64 budget)
+: _size(size)
+, _slotsCount(std::max(int(budget / (size * size * 4)), kColumns)) {
+}
+
+TileAtlas::Tile TileAtlas::lookup(int index) {
+	if (const auto i = _slots.find(index); i != end(_slots)) {
+		const auto slot = i->second;
+		_lru.splice(begin(_lru), _lru, _lruPositions[slot]);
+		return tile(slot, true);
+	}
+	auto slot = 0;
+	if (_slotIndices.size() < _slotsCount) {
+		slot = int(_slotIndices.size());
+		_slotIndices.push_back(index);
+		_lru.push_front(slot);
+		_lruPositions.push_back(begin(_lru));
+	} else {
+		slot = _lru.back();
+		if (_slotIndices[slot] >= 0) {
+			_slots.remove(_slotIndices[slot]);
+		}
+		_slotIndices[slot] = index;
+		_lru.splice(begin(_lru), _lru, _lruPositions[slot]);
+	}
+	_slots.emplace(index, slot);
+	return tile(slot, false);
+}
+
+void TileAtlas::remove(int index) {
+	const auto i = _slots.find(index);
+	if (i == end(_slots)) {
+		return;
+	}
+	const auto slot = i->second;
+	_slots.erase(i);
+	_slotIndices[slot] = -1;
+	_lru.splice(end(_lru), _lru, _lruPositions[slot]);
+}
+
+void TileAtlas::clear() {
+	_pages.clear();
+	_slotIndices.clear();
+	_slots.clear();
+	_lru.clear();
+	_lruPositions.clear();
+}
+
+TileAtlas::Tile TileAtlas::tile(int slot, bool filled) {
+	const auto page = slot / kSlotsPerPage;
+	if (page == _pages.size()) {
+		const auto slots = std::min(
+			kSlotsPerPage,
+			_slotsCount - page * kSlotsPerPage);
+		const auto rows = (slots + kColumns - 1) / kColumns;
+		_pages.emplace_back(
+			kColumns * _size,
+			rows * _size,
+			QImage::Format_ARGB32_Premultiplied);
+	}
+	const auto index = slot % kSlotsPerPage;
+	return {
+		.page = &_pages[page],
+		.rect = QRect(
+			(index % kColumns) * _size,
+			(index / kColumns) * _size,
+			_size,
+			_size),
+		.filled = filled,
+	};
+}
+
+Instance::Instance(int size, int64 tileCacheBudget)
+: _id(Universal->id())
+, _size(size)
+, _tiles(tileCacheBudget > 0
+	? std::make_unique<TileAtlas>(size, tileCacheBudget)
+	: nullptr) {
 	Expects(Universal != nullptr);
 
 	readCache();
@@ -790,10 +1186,22 @@ Instance::Instance(int size) : _id(Universal->id()), _size(size) {
 	}
 }
 
+bool Instance::spriteReady(int index) const {
+	return !_sprites[index].isNull() || _inFiles[index];
+}
+
 bool Instance::cached() const {
 	Expects(Universal != nullptr);
 
-	return (Universal->id() == _id) && (_sprites.size() == SpritesCount);
+	if (Universal->id() != _id || _sprites.size() != SpritesCount) {
+		return false;
+	}
+	for (auto i = 0; i != SpritesCount; ++i) {
+		if (!spriteReady(i)) {
+			return false;
+		}
+	}
+	return true;
 }
 
 void Instance::draw(QPainter &p, EmojiPtr emoji, int x, int y) {
@@ -802,25 +1210,82 @@ void Instance::draw(QPainter &p, EmojiPtr emoji, int x, int y) {
 	} else if (Universal && Universal->id() != _id) {
 		generateCache();
 	}
+	if (_tiles && drawTile(p, emoji, x, y)) {
+		return;
+	}
 	const auto sprite = emoji->sprite();
-	if (sprite >= _sprites.size()) {
+	if (sprite >= _sprites.size() || _sprites[sprite].isNull()) {
 		Assert(Universal != nullptr);
-		Universal->draw(p, emoji, _size, x, y);
+		if (Universal->ensureLoaded()) {
+			Universal->draw(p, emoji, _size, x, y);
+		}
 		return;
 	}
-	p.drawPixmap(
-		QPoint(x, y),
+	// Sprites read from the cache are read-only images over mapped files,
+	// so we don't set their device pixel ratio (that could detach them).
+	const auto factor = qreal(style::DevicePixelRatio());
+	p.drawImage(
+		QRectF(x, y, _size / factor, _size / factor),
 		_sprites[sprite],
 		QRect(emoji->column() * _size, emoji->row() * _size, _size, _size));
 }
 
+// If the tile can't be filled draw() uses the sprite or universal images.
+bool Instance::drawTile(QPainter &p, EmojiPtr emoji, int x, int y) {
+	Expects(_tiles != nullptr);
+
+	const auto tile = _tiles->lookup(emoji->index());
+	if (!tile.filled && !fillTile(emoji, tile)) {
+		_tiles->remove(emoji->index());
+		return false;
+	}
+	const auto factor = qreal(style::DevicePixelRatio());
+	p.drawImage(
+		QRectF(x, y, _size / factor, _size / factor),
+		*tile.page,
+		tile.rect);
+	return true;
+}
+
+// Sprites are kept in memory in this mode only if they couldn't be saved,
+// the tiles of the others are read from their cache files.
+bool Instance::fillTile(EmojiPtr emoji, const TileAtlas::Tile &tile) {
+	const auto sprite = emoji->sprite();
+	if (sprite < _inFiles.size() && _inFiles[sprite]) {
+		if (ReadFromFile(_id, _size, emoji, tile.page, tile.rect.topLeft())) {
+			return true;
+		}
+		// The file was removed or broken, the sprite is generated again.
+		_inFiles[sprite] = false;
+		generateCache();
+		return false;
+	} else if (sprite >= _sprites.size() || _sprites[sprite].isNull()) {
+		return false;
+	}
+	auto p = QPainter(tile.page);
+	p.setCompositionMode(QPainter::CompositionMode_Source);
+	p.drawImage(
+		tile.rect.topLeft(),
+		_sprites[sprite],
+		QRect(
+			emoji->column() * _size,
+			emoji->row() * _size,
+			_size,
+			_size));
+	return true;
+}
+
 void Instance::readCache() {
-	for (auto i = 0; i != SpritesCount; ++i) {
-		auto image = LoadFromFile(_id, _size, i);
-		if (image.isNull()) {
-			return;
+	_sprites.resize(SpritesCount);
+	_inFiles.resize(SpritesCount);
+	if (_tiles) {
+		for (auto i = 0; i != SpritesCount; ++i) {
+			_inFiles[i] = (OpenCheckedCacheFile(_id, _size, i) != nullptr);
 		}
-		pushSprite(std::move(image));
+		return;
+	}
+	for (auto i = 0; i != SpritesCount; ++i) {
+		_sprites[i] = LoadFromFile(_id, _size, i);
 	}
 }
 
@@ -829,8 +1294,13 @@ void Instance::checkUniversalImages() {
 
 	if (_id != Universal->id()) {
 		_id = Universal->id();
-		_generating = nullptr;
-		_sprites.clear();
+		_generating.clear();
+		_sprites = std::vector<QImage>(SpritesCount);
+		_inFiles = std::vector<bool>(SpritesCount);
+		_generated.clear();
+		if (_tiles) {
+			_tiles->clear();
+		}
 	}
 	if (!Universal->ensureLoaded()) {
 		if (Universal->id() != 0) {
@@ -845,37 +1315,70 @@ void Instance::generateCache() {
 	checkUniversalImages();
 
 	const auto cachePath = internal::CacheFileFolder();
-	if (cachePath.isEmpty()) {
+	if (_unsupported || cachePath.isEmpty()) {
 		return;
 	}
+
+	// All missing sprites are generated concurrently and are put to their
+	// slots in order, each one as soon as it and the previous ones are
+	// ready, so draw() can use them. Clearing _generating cancels all the
+	// jobs that weren't done yet.
 	const auto size = _size;
-	const auto index = _sprites.size();
-	crl::async([
-		=,
-		universal = Universal,
-		guard = _generating.make_guard()
-	]() mutable {
-		auto image = universal->generate(size, index);
-		crl::on_main(std::move(guard), [
-			=,
-			image = std::move(image)
+	_generating.resize(SpritesCount);
+	for (auto index = 0; index != SpritesCount; ++index) {
+		if (spriteReady(index)
+			|| _generating[index].alive()
+			|| _generated.contains(index)) {
+			continue;
+		}
+		crl::async([
+			this,
+			index,
+			size,
+			universal = Universal,
+			guard = _generating[index].make_guard()
 		]() mutable {
-			if (universal != Universal) {
+			if (!guard.alive()) {
 				return;
 			}
-			pushSprite(std::move(image));
-			if (cached()) {
-				ClearUniversalChecked();
-			} else {
-				generateCache();
-			}
+			auto image = universal->generate(size, index);
+			crl::on_main(std::move(guard), [
+				this,
+				index,
+				universal,
+				image = std::move(image)
+			]() mutable {
+				if (universal->id() != _id) {
+					return;
+				}
+				_generated.emplace(index, std::move(image));
+				applyGenerated();
+			});
 		});
-	});
+	}
 }
 
-void Instance::pushSprite(QImage &&data) {
-	_sprites.push_back(PixmapFromImage(std::move(data)));
-	_sprites.back().setDevicePixelRatio(style::DevicePixelRatio());
+void Instance::applyGenerated() {
+	while (!_generated.empty()) {
+		const auto i = begin(_generated);
+		const auto index = i->first;
+		for (auto previous = 0; previous != index; ++previous) {
+			if (!spriteReady(previous)) {
+				return;
+			}
+		}
+		if (_tiles && OpenCacheFile(_id, _size, index)) {
+			// The sprite was saved by generate(), tiles are read
+			// from the file, so it isn't kept in memory.
+			_inFiles[index] = true;
+		} else {
+			_sprites[index] = std::move(i->second);
+		}
+		_generated.erase(i);
+	}
+	if (cached()) {
+		ClearUniversalChecked();
+	}
 }
 
 const std::shared_ptr<UniversalImages> &SourceImages() {
@@ -25,6 +25,16 @@ namespace internal {
 
 } // namespace internal
 
+extern const char kOptionEmojiTileCache[];
+
+// By default full sprite sheets of every emoji size are kept in memory.
+// With a positive budget (split between the emoji sizes) only single emoji
+// are read from the cache files to an atlas when they are drawn and the
+// least recently used ones are evicted, so the memory is limited by the
+// budget. Must be called before Init(), the kOptionEmojiTileCache option
+// enables a default budget.
+void SetTileCacheBudget(int64 bytes);
+
 void Init();
 void Clear();
 
@@ -124,9 +134,11 @@ private:
 	return nullptr;
 }
 
-[[nodiscard]] inline EmojiPtr Find(const QChar *start, const QChar *end, int *outLength = nullptr) {
-	return internal::Find(start, end, outLength);
-}
+// Uses the table built in Init(), the generated matcher before that.
+[[nodiscard]] EmojiPtr Find(
+	const QChar *start,
+	const QChar *end,
+	int *outLength = nullptr);
 
 [[nodiscard]] inline EmojiPtr Find(const QString &text, int *outLength = nullptr) {
 	return Find(text.constBegin(), text.constEnd(), outLength);
@@ -155,7 +167,23 @@ private:
 
 QVector<EmojiPtr> GetDefaultRecent();
 
-const QPixmap &SinglePixmap(EmojiPtr emoji, int fontHeight);
+struct SinglePixmapCacheStats {
+	int64 hits = 0;
+	int64 misses = 0;
+	int64 evictions = 0;
+	int64 bytes = 0;
+	int count = 0;
+};
+
+// SinglePixmap() results are kept in an LRU cache limited by bytes.
+void SetSinglePixmapCacheBudget(int64 bytes);
+[[nodiscard]] SinglePixmapCacheStats SinglePixmapCacheStatistics();
+
+// Prepares pixmaps on main thread in small chunks, while they fit
+// in the cache budget without evicting anything. For recent emoji.
+void PrefillSinglePixmaps(std::vector<EmojiPtr> list, int fontHeight);
+
+[[nodiscard]] QPixmap SinglePixmap(EmojiPtr emoji, int fontHeight);
 void Draw(QPainter &p, EmojiPtr emoji, int size, int x, int y);
 
 class UniversalImages {
@@ -0,0 +1,203 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#include "ui/emoji_matcher.h"
+
+#include "ui/emoji_config.h"
+
+#include <algorithm>
+#include <map>
+
+namespace Ui {
+namespace Emoji {
+namespace {
+
+// At most 2^kMaxPostfixSlots spellings are looked up for one emoji.
+constexpr auto kMaxPostfixSlots = 4;
+
+// A node is dense if it has many transitions in a narrow range of units,
+// like the low surrogates after the common high ones.
+constexpr auto kMinDenseCount = 8;
+constexpr auto kMaxDenseSpread = 4;
+
+struct BuildingNode {
+	std::map<ushort, uint32> children;
+	EmojiPtr emoji = nullptr;
+};
+
+[[nodiscard]] std::vector<QString> Spellings(EmojiPtr emoji) {
+	const auto postfix = QChar(kPostfix);
+
+	// Positions in the sequence without postfixes where one may follow.
+	auto bare = QString();
+	auto slots = std::vector<int>();
+	const auto addSlot = [&] {
+		if (slots.empty() || slots.back() != bare.size()) {
+			slots.push_back(bare.size());
+		}
+	};
+	for (const auto ch : emoji->text()) {
+		if (ch == postfix) {
+			addSlot();
+		} else {
+			bare.append(ch);
+		}
+	}
+	addSlot();
+
+	const auto count = std::min(int(slots.size()), kMaxPostfixSlots);
+	auto result = std::vector<QString>{ emoji->id(), emoji->text() };
+	for (auto mask = 0; mask != (1 << count); ++mask) {
+		auto spelling = QString();
+		spelling.reserve(bare.size() + count);
+		auto from = 0;
+		for (auto i = 0; i != count; ++i) {
+			if (mask & (1 << i)) {
+				spelling.append(
+					base::StringViewMid(bare, from, slots[i] - from));
+				spelling.append(postfix);
+				from = slots[i];
+			}
+		}
+		spelling.append(base::StringViewMid(bare, from));
+		result.push_back(std::move(spelling));
+	}
+	return result;
+}
+
+} // namespace
+
+void Matcher::fill() {
+	auto building = std::vector<BuildingNode>(1);
+	const auto insert = [&](const QString &sequence, EmojiPtr emoji) {
+		auto index = uint32(0);
+		for (const auto ch : sequence) {
+			const auto i = building[index].children.find(ch.unicode());
+			if (i != end(building[index].children)) {
+				index = i->second;
+			} else {
+				const auto added = uint32(building.size());
+				building[index].children.emplace(ch.unicode(), added);
+				building.emplace_back();
+				index = added;
+			}
+		}
+		if (!building[index].emoji) {
+			building[index].emoji = emoji;
+		}
+	};
+	for (auto i = 0, count = internal::FullCount(); i != count; ++i) {
+		const auto emoji = internal::ByIndex(i);
+		if (!emoji) {
+			continue;
+		}
+		for (const auto &spelling : Spellings(emoji)) {
+			auto length = 0;
+			const auto found = internal::Find(
+				spelling.constBegin(),
+				spelling.constEnd(),
+				&length);
+			if (found && length == spelling.size()) {
+				insert(spelling, found);
+			}
+		}
+	}
+
+	// Building node 0 is the root, others keep their indices as nodes.
+	_rootBlocks.fill(0);
+	_root.clear();
+	for (const auto &[unit, index] : building.front().children) {
+		auto &block = _rootBlocks[unit >> 8];
+		if (!block) {
+			_root.push_back({ { 0 } });
+			block = ushort(_root.size());
+		}
+		_root[block - 1][unit & 0xFF] = index;
+	}
+	_nodes = std::vector<Node>(building.size());
+	_units.clear();
+	_targets.clear();
+	_dense.clear();
+	for (auto i = 1; i != int(building.size()); ++i) {
+		const auto &children = building[i].children;
+		auto &node = _nodes[i];
+		node.emoji = building[i].emoji;
+		if (children.empty()) {
+			continue;
+		}
+		const auto min = children.begin()->first;
+		const auto spread = int(children.rbegin()->first - min) + 1;
+		const auto count = int(children.size());
+		node.min = min;
+		node.dense = (count >= kMinDenseCount)
+			&& (spread <= count * kMaxDenseSpread);
+		if (node.dense) {
+			node.first = uint32(_dense.size());
+			node.count = ushort(spread);
+			_dense.resize(_dense.size() + spread);
+			for (const auto &[unit, index] : children) {
+				_dense[node.first + (unit - min)] = index;
+			}
+		} else {
+			node.first = uint32(_units.size());
+			node.count = ushort(count);
+			for (const auto &[unit, index] : children) {
+				_units.push_back(unit);
+				_targets.push_back(index);
+			}
+		}
+	}
+}
+
+bool Matcher::empty() const {
+	return _nodes.empty();
+}
+
+uint32 Matcher::child(const Node &node, ushort unit) const {
+	if (node.dense) {
+		const auto offset = ushort(unit - node.min);
+		return (offset < node.count) ? _dense[node.first + offset] : 0;
+	}
+	const auto from = begin(_units) + node.first;
+	const auto till = from + node.count;
+	const auto i = std::lower_bound(from, till, unit);
+	return (i != till && *i == unit) ? _targets[i - begin(_units)] : 0;
+}
+
+EmojiPtr Matcher::find(
+		const QChar *start,
+		const QChar *end,
+		int *outLength) const {
+	if (start == end) {
+		return nullptr;
+	}
+	const auto unit = start->unicode();
+	const auto block = _rootBlocks[unit >> 8];
+	if (!block) {
+		return nullptr;
+	}
+	auto result = EmojiPtr();
+	auto length = 0;
+	auto index = _root[block - 1][unit & 0xFF];
+	for (auto ch = start + 1; index != 0; ++ch) {
+		const auto &node = _nodes[index];
+		if (node.emoji) {
+			result = node.emoji;
+			length = int(ch - start);
+		}
+		if (ch == end) {
+			break;
+		}
+		index = child(node, ch->unicode());
+	}
+	if (result && outLength) {
+		*outLength = length;
+	}
+	return result;
+}
+
+} // namespace Emoji
+} // namespace Ui
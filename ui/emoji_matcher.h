@@ -0,0 +1,64 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#pragma once
+
+#include "base/basic_types.h"
+#include "emoji.h"
+
+#include <array>
+#include <vector>
+
+namespace Ui {
+namespace Emoji {
+
+// Table driven emoji sequence matcher, a trie of UTF-16 code units.
+//
+// It is filled from the generated internal::Find(): every emoji id, its
+// text with kPostfix and the spellings with kPostfix added or dropped
+// after the code points that can have it are looked up there, and those
+// matched entirely are added. So for them, including ZWJ sequences and
+// skin tone modifiers, the results and lengths are the same.
+class Matcher final {
+public:
+	void fill();
+	[[nodiscard]] bool empty() const;
+
+	// Finds the longest sequence at start, like internal::Find().
+	[[nodiscard]] EmojiPtr find(
+		const QChar *start,
+		const QChar *end,
+		int *outLength = nullptr) const;
+
+private:
+	struct Node {
+		EmojiPtr emoji = nullptr;
+		uint32 first = 0;
+		ushort min = 0;
+		ushort count = 0;
+		bool dense = false;
+	};
+
+	[[nodiscard]] uint32 child(const Node &node, ushort unit) const;
+
+	// Root transitions by the high and then by the low byte of the unit,
+	// most of the text is rejected with two loads.
+	std::array<ushort, 256> _rootBlocks = { { 0 } };
+	std::vector<std::array<uint32, 256>> _root;
+
+	// Node 0 is a sentinel, child() returns 0 if there is no transition.
+	std::vector<Node> _nodes;
+
+	// Sparse nodes keep sorted units with their targets at the same
+	// offsets, dense nodes keep targets for each unit in [min, min + count).
+	std::vector<ushort> _units;
+	std::vector<uint32> _targets;
+	std::vector<uint32> _dense;
+
+};
+
+} // namespace Emoji
+} // namespace Ui
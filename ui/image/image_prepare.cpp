@@ -6,9 +6,11 @@
 //
 #include "ui/image/image_prepare.h"
 
+#include "ui/image/image_queue.h"
 #include "ui/effects/animation_value.h"
 #include "ui/style/style_core.h"
 #include "ui/painter.h"
+#include "ui/ui_simd.h"
 #include "base/flat_map.h"
 #include "base/debug_log.h"
 #include "base/bytes.h"
@@ -16,20 +18,38 @@
 #include "styles/style_basic.h"
 
 #include <zlib.h>
+#include <xxhash.h>
 #include <QtCore/QFile>
 #include <QtCore/QBuffer>
 #include <QtCore/QMutex>
 #include <QtGui/QImageReader>
 #include <QtSvg/QSvgRenderer>
 
+#include <crl/crl_async.h>
+#include <crl/crl_semaphore.h>
+
 #include <jpeglib.h>
 
+#include <array>
+#include <atomic>
+#include <list>
+#include <thread>
+
 namespace Images {
 namespace {
 
 // They should be smaller.
 constexpr auto kMaxGzipFileSize = 5 * 1024 * 1024;
 
+constexpr auto kGradientProgressSteps = 64;
+constexpr auto kGradientCacheBudget = 32 * 1024 * 1024;
+constexpr auto kSvgCacheBudget = 16 * 1024 * 1024;
+constexpr auto kMinGzipChunk = 64 * 1024;
+
+constexpr auto kBlurRowsPerJob = 32;
+constexpr auto kBlurColumnsPerJob = 64;
+constexpr auto kDitherRowsPerJob = 64;
+
 TG_FORCE_INLINE uint64 BlurGetColors(const uchar *p) {
 	return (uint64)p[0]
 		+ ((uint64)p[1] << 16)
@@ -37,50 +57,717 @@ TG_FORCE_INLINE uint64 BlurGetColors(const uchar *p) {
 		+ ((uint64)p[3] << 48);
 }
 
-const QImage &EllipseMaskCached(QSize size) {
-	const auto key = (uint64(uint32(size.width())) << 32)
-		| uint64(uint32(size.height()));
+struct ParallelJobs {
+	Fn<void(int)> method;
+	int count = 0;
+	std::atomic<int> next = 0;
+	std::atomic<int> left = 0;
+	crl::semaphore done;
+};
+
+void RunParallelJobs(const std::shared_ptr<ParallelJobs> &jobs) {
+	while (true) {
+		const auto index = jobs->next++;
+		if (index >= jobs->count) {
+			return;
+		}
+		jobs->method(index);
+		if (--jobs->left == 0) {
+			jobs->done.release();
+		}
+	}
+}
 
-	static auto Masks = base::flat_map<uint64, QImage>();
-	static auto Mutex = QMutex();
-	auto lock = QMutexLocker(&Mutex);
-	const auto i = Masks.find(key);
-	if (i != end(Masks)) {
-		return i->second;
+// Calls method for each index in [0, count) on crl::async() workers and
+// on the calling thread, returns when all the calls are finished.
+// The caller only waits for the jobs already taken by the workers.
+void ParallelFor(int count, Fn<void(int)> method) {
+	if (count <= 1) {
+		if (count == 1) {
+			method(0);
+		}
+		return;
+	}
+	const auto jobs = std::make_shared<ParallelJobs>();
+	jobs->method = std::move(method);
+	jobs->count = count;
+	jobs->left = count;
+	const auto threads = std::max(int(std::thread::hardware_concurrency()), 1);
+	for (auto i = 1, helpers = std::min(count, threads); i < helpers; ++i) {
+		crl::async([=] { RunParallelJobs(jobs); });
+	}
+	RunParallelJobs(jobs);
+	jobs->done.acquire();
+}
+
+// Running sums of one row or column of the BlurLargeImage stack blur.
+struct BlurSums {
+	template <typename Sample>
+	void add(const Sample *sample, int weight, bool incoming) {
+		for (auto c = 0; c != 3; ++c) {
+			sum[c] += int(sample[c]) * weight;
+			(incoming ? in : out)[c] += sample[c];
+		}
 	}
-	lock.unlock();
 
-	auto mask = EllipseMask(size, 1.);
+	template <typename Result, typename Sample>
+	void step(
+			Result *result,
+			const int *dv,
+			const Sample *leaving,
+			const Sample *entering,
+			const Sample *middle) {
+		for (auto c = 0; c != 3; ++c) {
+			result[c] = dv[sum[c]];
+			sum[c] -= out[c];
+			out[c] -= leaving[c];
+			in[c] += entering[c];
+			sum[c] += in[c];
+			out[c] += middle[c];
+			in[c] -= middle[c];
+		}
+	}
 
-	lock.relock();
-	return Masks.emplace(key, std::move(mask)).first->second;
+	std::array<int, 3> sum = { { 0 } };
+	std::array<int, 3> in = { { 0 } };
+	std::array<int, 3> out = { { 0 } };
+};
+
+// Horizontal pass of Blur() for pairs of rows, stores the same
+// 16 bit per channel sums as the scalar loop. Returns the rows count done.
+int BlurRowsVectorized(
+		const uchar *pix,
+		uint64 *rgb,
+		int w,
+		int h,
+		int stride,
+		int radius) {
+	const auto r1 = radius + 1;
+	const auto center = (r1 * (r1 + 1)) >> 1;
+	auto y = 0;
+#if defined UI_SIMD_SSE2
+	const auto zero = _mm_setzero_si128();
+	for (; y + 2 <= h; y += 2) {
+		const auto first = reinterpret_cast<const int*>(pix + y * stride);
+		const auto second = reinterpret_cast<const int*>(
+			pix + (y + 1) * stride);
+		const auto load = [&](int x) {
+			return _mm_unpacklo_epi8(
+				_mm_unpacklo_epi32(
+					_mm_cvtsi32_si128(first[x]),
+					_mm_cvtsi32_si128(second[x])),
+				zero);
+		};
+		auto cur = load(0);
+		auto allsum = _mm_mullo_epi16(cur, _mm_set1_epi16(-radius));
+		auto sum = _mm_mullo_epi16(cur, _mm_set1_epi16(center));
+		for (auto i = 1; i <= radius; ++i) {
+			cur = load(i);
+			sum = _mm_add_epi16(
+				sum,
+				_mm_mullo_epi16(cur, _mm_set1_epi16(r1 - i)));
+			allsum = _mm_add_epi16(allsum, cur);
+		}
+		const auto out = rgb + y * w;
+		for (auto x = 0; x != w; ++x) {
+			const auto result = _mm_srli_epi16(sum, 4);
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(out + x), result);
+			_mm_storel_epi64(
+				reinterpret_cast<__m128i*>(out + w + x),
+				_mm_srli_si128(result, 8));
+			const auto middle = load(x);
+			allsum = _mm_add_epi16(
+				_mm_sub_epi16(
+					_mm_sub_epi16(
+						_mm_add_epi16(allsum, load(std::max(x - r1, 0))),
+						middle),
+					middle),
+				load(std::min(x + r1, w - 1)));
+			sum = _mm_add_epi16(sum, allsum);
+		}
+	}
+#elif defined UI_SIMD_NEON
+	for (; y + 2 <= h; y += 2) {
+		const auto first = reinterpret_cast<const uint32_t*>(
+			pix + y * stride);
+		const auto second = reinterpret_cast<const uint32_t*>(
+			pix + (y + 1) * stride);
+		const auto load = [&](int x) {
+			return vmovl_u8(vreinterpret_u8_u32(vset_lane_u32(
+				second[x],
+				vdup_n_u32(first[x]),
+				1)));
+		};
+		auto cur = load(0);
+		auto allsum = vmulq_n_u16(cur, uint16(-radius));
+		auto sum = vmulq_n_u16(cur, uint16(center));
+		for (auto i = 1; i <= radius; ++i) {
+			cur = load(i);
+			sum = vmlaq_n_u16(sum, cur, uint16(r1 - i));
+			allsum = vaddq_u16(allsum, cur);
+		}
+		const auto out = reinterpret_cast<uint16_t*>(rgb + y * w);
+		for (auto x = 0; x != w; ++x) {
+			const auto result = vshrq_n_u16(sum, 4);
+			vst1_u16(out + x * 4, vget_low_u16(result));
+			vst1_u16(out + (w + x) * 4, vget_high_u16(result));
+			const auto middle = load(x);
+			allsum = vaddq_u16(
+				vsubq_u16(
+					vsubq_u16(
+						vaddq_u16(allsum, load(std::max(x - r1, 0))),
+						middle),
+					middle),
+				load(std::min(x + r1, w - 1)));
+			sum = vaddq_u16(sum, allsum);
+		}
+	}
+#endif // UI_SIMD_SSE2 || UI_SIMD_NEON
+	return y;
+}
+
+// Vertical pass of Blur() for groups of columns, writes the pixels just
+// like the scalar loop. Returns the columns count done.
+int BlurColumnsVectorized(
+		uchar *pix,
+		const uint64 *rgb,
+		int w,
+		int h,
+		int stride,
+		int radius) {
+	const auto r1 = radius + 1;
+	const auto center = (r1 * (r1 + 1)) >> 1;
+	auto x = 0;
+#if defined UI_SIMD_AVX2
+	for (; x + 4 <= w; x += 4) {
+		const auto load = [&](int y) {
+			return _mm256_loadu_si256(
+				reinterpret_cast<const __m256i*>(rgb + y * w + x));
+		};
+		auto cur = load(0);
+		auto allsum = _mm256_mullo_epi16(cur, _mm256_set1_epi16(-radius));
+		auto sum = _mm256_mullo_epi16(cur, _mm256_set1_epi16(center));
+		for (auto i = 1; i <= radius; ++i) {
+			cur = load(i);
+			sum = _mm256_add_epi16(
+				sum,
+				_mm256_mullo_epi16(cur, _mm256_set1_epi16(r1 - i)));
+			allsum = _mm256_add_epi16(allsum, cur);
+		}
+		for (auto y = 0; y != h; ++y) {
+			const auto result = _mm256_srli_epi16(sum, 4);
+			const auto packed = _mm256_permute4x64_epi64(
+				_mm256_packus_epi16(result, result),
+				0x08);
+			_mm_storeu_si128(
+				reinterpret_cast<__m128i*>(pix + y * stride + x * 4),
+				_mm256_castsi256_si128(packed));
+			const auto middle = load(y);
+			allsum = _mm256_add_epi16(
+				_mm256_sub_epi16(
+					_mm256_sub_epi16(
+						_mm256_add_epi16(allsum, load(std::max(y - r1, 0))),
+						middle),
+					middle),
+				load(std::min(y + r1, h - 1)));
+			sum = _mm256_add_epi16(sum, allsum);
+		}
+	}
+#endif // UI_SIMD_AVX2
+#if defined UI_SIMD_SSE2
+	for (; x + 2 <= w; x += 2) {
+		const auto load = [&](int y) {
+			return _mm_loadu_si128(
+				reinterpret_cast<const __m128i*>(rgb + y * w + x));
+		};
+		auto cur = load(0);
+		auto allsum = _mm_mullo_epi16(cur, _mm_set1_epi16(-radius));
+		auto sum = _mm_mullo_epi16(cur, _mm_set1_epi16(center));
+		for (auto i = 1; i <= radius; ++i) {
+			cur = load(i);
+			sum = _mm_add_epi16(
+				sum,
+				_mm_mullo_epi16(cur, _mm_set1_epi16(r1 - i)));
+			allsum = _mm_add_epi16(allsum, cur);
+		}
+		for (auto y = 0; y != h; ++y) {
+			const auto result = _mm_srli_epi16(sum, 4);
+			_mm_storel_epi64(
+				reinterpret_cast<__m128i*>(pix + y * stride + x * 4),
+				_mm_packus_epi16(result, result));
+			const auto middle = load(y);
+			allsum = _mm_add_epi16(
+				_mm_sub_epi16(
+					_mm_sub_epi16(
+						_mm_add_epi16(allsum, load(std::max(y - r1, 0))),
+						middle),
+					middle),
+				load(std::min(y + r1, h - 1)));
+			sum = _mm_add_epi16(sum, allsum);
+		}
+	}
+#elif defined UI_SIMD_NEON
+	for (; x + 2 <= w; x += 2) {
+		const auto load = [&](int y) {
+			return vld1q_u16(
+				reinterpret_cast<const uint16_t*>(rgb + y * w + x));
+		};
+		auto cur = load(0);
+		auto allsum = vmulq_n_u16(cur, uint16(-radius));
+		auto sum = vmulq_n_u16(cur, uint16(center));
+		for (auto i = 1; i <= radius; ++i) {
+			cur = load(i);
+			sum = vmlaq_n_u16(sum, cur, uint16(r1 - i));
+			allsum = vaddq_u16(allsum, cur);
+		}
+		for (auto y = 0; y != h; ++y) {
+			vst1_u8(pix + y * stride + x * 4, vshrn_n_u16(sum, 4));
+			const auto middle = load(y);
+			allsum = vaddq_u16(
+				vsubq_u16(
+					vsubq_u16(
+						vaddq_u16(allsum, load(std::max(y - r1, 0))),
+						middle),
+					middle),
+				load(std::min(y + r1, h - 1)));
+			sum = vaddq_u16(sum, allsum);
+		}
+	}
+#endif // UI_SIMD_SSE2 || UI_SIMD_NEON
+	return x;
+}
+
+#if defined UI_SIMD_AVX2_DISPATCH
+// The AVX2 part of ColoredRowVectorized(), see it for the details.
+UI_SIMD_AVX2_TARGET inline __m256i ColoredAvx2(
+		const __m256i &pixels,
+		const __m256i &ratio,
+		const __m256i &color) {
+	const auto one = _mm256_set1_epi16(1);
+	const auto sign = _mm256_set1_epi16(int16(0x8000));
+	const auto alpha = _mm256_add_epi16(
+		_mm256_shufflehi_epi16(
+			_mm256_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3)),
+			_MM_SHUFFLE(3, 3, 3, 3)),
+		one);
+	const auto kept = _mm256_mullo_epi16(pixels, ratio);
+	const auto low = _mm256_mullo_epi16(alpha, color);
+	const auto high = _mm256_mulhi_epu16(alpha, color);
+	const auto shifted = _mm256_slli_epi16(kept, 8);
+	const auto carry = _mm256_cmpgt_epi16(
+		_mm256_xor_si256(shifted, sign),
+		_mm256_xor_si256(_mm256_add_epi16(shifted, low), sign));
+	return _mm256_sub_epi16(
+		_mm256_add_epi16(high, _mm256_srli_epi16(kept, 8)),
+		carry);
+}
+
+UI_SIMD_AVX2_TARGET int ColoredRowAvx2(
+		uchar *pix,
+		int w,
+		int16 r,
+		int16 cr,
+		int16 cg,
+		int16 cb) {
+	const auto zero = _mm256_setzero_si256();
+	const auto ratio = _mm256_setr_epi16(
+		r, r, r, 0x100, r, r, r, 0x100,
+		r, r, r, 0x100, r, r, r, 0x100);
+	const auto color = _mm256_setr_epi16(
+		cb, cg, cr, 0, cb, cg, cr, 0,
+		cb, cg, cr, 0, cb, cg, cr, 0);
+	auto x = 0;
+	for (; x + 8 <= w; x += 8) {
+		const auto to = reinterpret_cast<__m256i*>(pix + x * 4);
+		const auto pixels = _mm256_loadu_si256(to);
+		_mm256_storeu_si256(to, _mm256_packus_epi16(
+			ColoredAvx2(_mm256_unpacklo_epi8(pixels, zero), ratio, color),
+			ColoredAvx2(_mm256_unpackhi_epi8(pixels, zero), ratio, color)));
+	}
+	return x;
+}
+#endif // UI_SIMD_AVX2_DISPATCH
+
+// Colored() for a row of premultiplied pixels, gives the same bytes as
+// the scalar loop. The 16 bit lanes take r * p for the (256 - ca) * 256
+// part and the high and low halves of a * c for the color part, adding the
+// carry of the low halves by hand. Returns the pixels count done.
+int ColoredRowVectorized(uchar *pix, int w, QColor add) {
+	const auto ca = add.alpha();
+	const auto r = int16(0x100 - ca);
+	const auto cr = int16(add.red() * (ca + 1));
+	const auto cg = int16(add.green() * (ca + 1));
+	const auto cb = int16(add.blue() * (ca + 1));
+	auto x = 0;
+#if defined UI_SIMD_AVX2_DISPATCH
+	if (Ui::SimdHasAvx2()) {
+		x = ColoredRowAvx2(pix, w, r, cr, cg, cb);
+	}
+#endif // UI_SIMD_AVX2_DISPATCH
+#if defined UI_SIMD_SSE2
+	const auto zero = _mm_setzero_si128();
+	const auto one = _mm_set1_epi16(1);
+	const auto sign = _mm_set1_epi16(int16(0x8000));
+	const auto ratio = _mm_setr_epi16(r, r, r, 0x100, r, r, r, 0x100);
+	const auto color = _mm_setr_epi16(cb, cg, cr, 0, cb, cg, cr, 0);
+	const auto apply = [&](__m128i pixels) {
+		const auto alpha = _mm_add_epi16(
+			_mm_shufflehi_epi16(
+				_mm_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3)),
+				_MM_SHUFFLE(3, 3, 3, 3)),
+			one);
+		const auto kept = _mm_mullo_epi16(pixels, ratio);
+		const auto low = _mm_mullo_epi16(alpha, color);
+		const auto high = _mm_mulhi_epu16(alpha, color);
+		const auto shifted = _mm_slli_epi16(kept, 8);
+		const auto carry = _mm_cmpgt_epi16(
+			_mm_xor_si128(shifted, sign),
+			_mm_xor_si128(_mm_add_epi16(shifted, low), sign));
+		return _mm_sub_epi16(
+			_mm_add_epi16(high, _mm_srli_epi16(kept, 8)),
+			carry);
+	};
+	for (; x + 4 <= w; x += 4) {
+		const auto to = reinterpret_cast<__m128i*>(pix + x * 4);
+		const auto pixels = _mm_loadu_si128(to);
+		_mm_storeu_si128(to, _mm_packus_epi16(
+			apply(_mm_unpacklo_epi8(pixels, zero)),
+			apply(_mm_unpackhi_epi8(pixels, zero))));
+	}
+#elif defined UI_SIMD_NEON
+	const uint16_t ratios[4] = {
+		uint16_t(r),
+		uint16_t(r),
+		uint16_t(r),
+		uint16_t(0x100),
+	};
+	const uint16_t colors[4] = {
+		uint16_t(cb),
+		uint16_t(cg),
+		uint16_t(cr),
+		uint16_t(0),
+	};
+	const auto ratio = vld1_u16(ratios);
+	const auto color = vld1_u16(colors);
+	const auto apply = [&](uint16x4_t pixel, uint16x4_t alpha) {
+		return vshrn_n_u32(
+			vmlal_u16(
+				vshlq_n_u32(vmull_u16(pixel, ratio), 8),
+				alpha,
+				color),
+			16);
+	};
+	const auto one = vdupq_n_u16(1);
+	for (; x + 4 <= w; x += 4) {
+		const auto to = pix + x * 4;
+		const auto pixels = vld1q_u8(to);
+		const auto spread = vreinterpretq_u8_u32(vmulq_n_u32(
+			vshrq_n_u32(vreinterpretq_u32_u8(pixels), 24),
+			0x01010101U));
+		const auto alphasLow = vaddq_u16(vmovl_u8(vget_low_u8(spread)), one);
+		const auto alphasHigh = vaddq_u16(
+			vmovl_u8(vget_high_u8(spread)),
+			one);
+		const auto low = vmovl_u8(vget_low_u8(pixels));
+		const auto high = vmovl_u8(vget_high_u8(pixels));
+		vst1q_u8(to, vcombine_u8(
+			vmovn_u16(vcombine_u16(
+				apply(vget_low_u16(low), vget_low_u16(alphasLow)),
+				apply(vget_high_u16(low), vget_high_u16(alphasLow)))),
+			vmovn_u16(vcombine_u16(
+				apply(vget_low_u16(high), vget_low_u16(alphasHigh)),
+				apply(vget_high_u16(high), vget_high_u16(alphasHigh))))));
+	}
+#endif // UI_SIMD_SSE2 || UI_SIMD_NEON
+	return x;
+}
+
+#if defined UI_SIMD_AVX2_DISPATCH
+// The AVX2 part of OpaqueRowVectorized(), see it for the details.
+UI_SIMD_AVX2_TARGET int OpaqueRowAvx2(uint32 *ints, int w) {
+	auto x = 0;
+	for (; x + 8 <= w; x += 8) {
+		const auto to = reinterpret_cast<__m256i*>(ints + x);
+		const auto pixels = _mm256_loadu_si256(to);
+		const auto alpha = _mm256_srli_epi32(pixels, 24);
+		const auto pair = _mm256_or_si256(alpha, _mm256_slli_epi32(alpha, 8));
+		const auto alphas = _mm256_or_si256(
+			pair,
+			_mm256_slli_epi32(pair, 16));
+		_mm256_storeu_si256(to, _mm256_add_epi8(
+			pixels,
+			_mm256_xor_si256(alphas, _mm256_set1_epi32(-1))));
+	}
+	return x;
+}
+#endif // UI_SIMD_AVX2_DISPATCH
+
+// Opaque() for a row of premultiplied pixels. Over the white background
+// each channel becomes p + (255 - a), which is what the scalar loop gives.
+// Returns the pixels count done.
+int OpaqueRowVectorized(uint32 *ints, int w) {
+	auto x = 0;
+#if defined UI_SIMD_AVX2_DISPATCH
+	if (Ui::SimdHasAvx2()) {
+		x = OpaqueRowAvx2(ints, w);
+	}
+#endif // UI_SIMD_AVX2_DISPATCH
+#if defined UI_SIMD_SSE2
+	const auto full = _mm_set1_epi32(-1);
+	for (; x + 4 <= w; x += 4) {
+		const auto to = reinterpret_cast<__m128i*>(ints + x);
+		const auto pixels = _mm_loadu_si128(to);
+		const auto alpha = _mm_srli_epi32(pixels, 24);
+		const auto pair = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 8));
+		const auto alphas = _mm_or_si128(pair, _mm_slli_epi32(pair, 16));
+		_mm_storeu_si128(
+			to,
+			_mm_add_epi8(pixels, _mm_xor_si128(alphas, full)));
+	}
+#elif defined UI_SIMD_NEON
+	for (; x + 4 <= w; x += 4) {
+		const auto to = ints + x;
+		const auto pixels = vld1q_u32(to);
+		const auto alphas = vmulq_n_u32(vshrq_n_u32(pixels, 24), 0x01010101U);
+		vst1q_u32(to, vreinterpretq_u32_u8(vaddq_u8(
+			vreinterpretq_u8_u32(pixels),
+			vmvnq_u8(vreinterpretq_u8_u32(alphas)))));
+	}
+#endif // UI_SIMD_SSE2 || UI_SIMD_NEON
+	return x;
+}
+
+// Adds count bytes to count 16 bit sums.
+void AccumulateLine(const uchar *from, uint16 *to, int count) {
+	auto i = 0;
+#if defined UI_SIMD_AVX2
+	for (; i + 16 <= count; i += 16) {
+		const auto bytes = _mm256_cvtepu8_epi16(_mm_loadu_si128(
+			reinterpret_cast<const __m128i*>(from + i)));
+		const auto sums = reinterpret_cast<__m256i*>(to + i);
+		_mm256_storeu_si256(
+			sums,
+			_mm256_add_epi16(_mm256_loadu_si256(sums), bytes));
+	}
+#elif defined UI_SIMD_SSE2
+	const auto zero = _mm_setzero_si128();
+	for (; i + 16 <= count; i += 16) {
+		const auto bytes = _mm_loadu_si128(
+			reinterpret_cast<const __m128i*>(from + i));
+		const auto low = reinterpret_cast<__m128i*>(to + i);
+		const auto high = reinterpret_cast<__m128i*>(to + i + 8);
+		_mm_storeu_si128(
+			low,
+			_mm_add_epi16(
+				_mm_loadu_si128(low),
+				_mm_unpacklo_epi8(bytes, zero)));
+		_mm_storeu_si128(
+			high,
+			_mm_add_epi16(
+				_mm_loadu_si128(high),
+				_mm_unpackhi_epi8(bytes, zero)));
+	}
+#elif defined UI_SIMD_NEON
+	for (; i + 8 <= count; i += 8) {
+		vst1q_u16(to + i, vaddw_u8(vld1q_u16(to + i), vld1_u8(from + i)));
+	}
+#endif
+	for (; i != count; ++i) {
+		to[i] += from[i];
+	}
+}
+
+// Averages ratio consecutive pixels of 16 bit channel sums.
+void ReduceLine(const uint16 *sums, uchar *to, int width, int ratio) {
+	const auto area = uint32(ratio * ratio);
+	const auto half = area / 2;
+	uint32 channels[4];
+#if defined UI_SIMD_SSE2
+	const auto zero = _mm_setzero_si128();
+#endif
+	for (auto x = 0; x != width; ++x) {
+#if defined UI_SIMD_SSE2
+		auto accumulated = _mm_setzero_si128();
+		for (auto i = 0; i != ratio; ++i, sums += 4) {
+			const auto pixel = _mm_loadl_epi64(
+				reinterpret_cast<const __m128i*>(sums));
+			accumulated = _mm_add_epi32(
+				accumulated,
+				_mm_unpacklo_epi16(pixel, zero));
+		}
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(channels), accumulated);
+#elif defined UI_SIMD_NEON
+		auto accumulated = vdupq_n_u32(0);
+		for (auto i = 0; i != ratio; ++i, sums += 4) {
+			accumulated = vaddw_u16(accumulated, vld1_u16(sums));
+		}
+		vst1q_u32(channels, accumulated);
+#else
+		channels[0] = channels[1] = channels[2] = channels[3] = 0;
+		for (auto i = 0; i != ratio; ++i, sums += 4) {
+			channels[0] += sums[0];
+			channels[1] += sums[1];
+			channels[2] += sums[2];
+			channels[3] += sums[3];
+		}
+#endif
+		*to++ = uchar((channels[0] + half) / area);
+		*to++ = uchar((channels[1] + half) / area);
+		*to++ = uchar((channels[2] + half) / area);
+		*to++ = uchar((channels[3] + half) / area);
+	}
+}
+
+// Antialiased opacity of a pixel by the distance from its center
+// to the shape edge, positive distance is outside of the shape.
+[[nodiscard]] inline uint32 EdgeOpacity(float distance) {
+	return uint32(std::clamp(0.5f - distance, 0.f, 1.f) * 255.f + 0.5f);
+}
+
+// Multiplies a premultiplied pixel by an opacity, like the corner masks.
+inline void ApplyOpacity(uint32 &pixel, uint32 opacity) {
+	if (opacity != 0xFF) {
+		pixel = anim::unshifted(anim::shifted(pixel)
+			* static_cast<anim::ShiftedMultiplier>(opacity + 1));
+	}
+}
+
+// Opacities of the top left radius x radius corner of a rounded rect.
+[[nodiscard]] std::vector<uchar> CornerOpacities(int radius) {
+	auto result = std::vector<uchar>(radius * radius);
+	for (auto y = 0; y != radius; ++y) {
+		const auto dy = radius - (y + 0.5f);
+		for (auto x = 0; x != radius; ++x) {
+			const auto dx = radius - (x + 0.5f);
+			result[y * radius + x] = uchar(EdgeOpacity(
+				std::sqrt(dx * dx + dy * dy) - radius));
+		}
+	}
+	return result;
+}
+
+// Cuts the ellipse inscribed in the premultiplied target rect in place.
+// The optional color is added in the same pass, like Colored() does.
+void EllipseInPlace(QImage &image, QRect target, QColor add = QColor()) {
+	Expects(image.format() == QImage::Format_ARGB32_Premultiplied);
+
+	const auto a = target.width() / 2.f;
+	const auto b = target.height() / 2.f;
+	if (a <= 0.f || b <= 0.f) {
+		return;
+	}
+	const auto a2 = a * a;
+	const auto b2 = b * b;
+
+	// Pixels inside of the ellipse smaller by one pixel are opaque.
+	const auto inner = [&](float value) {
+		return std::max(value - 1.f, 0.f);
+	};
+	const auto ia2 = inner(a) * inner(a);
+	const auto ib2 = inner(b) * inner(b);
+
+	const auto colored = add.isValid();
+	const auto ca = add.alpha();
+	const auto cr = add.red() * (ca + 1);
+	const auto cg = add.green() * (ca + 1);
+	const auto cb = add.blue() * (ca + 1);
+	const auto ra = (0x100 - ca) * 0x100;
+	const auto colorize = [&](uint32 &pixel) {
+		const auto pix = reinterpret_cast<uchar*>(&pixel);
+		const auto alpha = pix[3] + 1;
+		pix[0] = (ra * pix[0] + alpha * cb) >> 16;
+		pix[1] = (ra * pix[1] + alpha * cg) >> 16;
+		pix[2] = (ra * pix[2] + alpha * cr) >> 16;
+	};
+
+	// Opacity falls monotonically from the middle of a row outwards,
+	// so each row walks its two edge bands and stops at the first
+	// transparent pixel. The interior is only colorized, if needed.
+	const auto width = target.width();
+	const auto middle = width / 2;
+	const auto opacityAt = [&](float px, float py) {
+		const auto f = px * px / a2 + py * py / b2 - 1.f;
+		const auto gx = px / a2;
+		const auto gy = py / b2;
+		const auto gradient = 2.f * std::sqrt(gx * gx + gy * gy);
+		return (gradient > 0.f) ? EdgeOpacity(f / gradient) : uint32(0xFF);
+	};
+	for (auto y = 0; y != target.height(); ++y) {
+		const auto line = reinterpret_cast<uint32*>(
+			image.scanLine(target.y() + y)) + target.x();
+		const auto py = (y + 0.5f) - b;
+		const auto py2 = py * py;
+
+		// Columns [width - till, till) are inside the smaller ellipse.
+		auto till = middle;
+		if (ia2 > 0.f && ib2 > 0.f && py2 <= ib2) {
+			const auto half = std::sqrt(ia2 * (1.f - py2 / ib2));
+			till = std::clamp(
+				int(std::floor(half + a - 0.5f)) + 1,
+				middle,
+				width);
+		}
+		if (colored) {
+			for (auto x = width - till; x < till; ++x) {
+				colorize(line[x]);
+			}
+		}
+		for (auto x = till; x != width; ++x) {
+			const auto mirrored = width - 1 - x;
+			const auto opacity = opacityAt((x + 0.5f) - a, py);
+			if (!opacity) {
+				std::fill(line + x, line + width, 0);
+				std::fill(line, line + mirrored + 1, 0);
+				break;
+			}
+			ApplyOpacity(line[x], opacity);
+			if (mirrored != x) {
+				ApplyOpacity(line[mirrored], opacity);
+			}
+			if (colored) {
+				colorize(line[x]);
+				if (mirrored != x) {
+					colorize(line[mirrored]);
+				}
+			}
+		}
+	}
 }
 
 std::array<QImage, 4> PrepareCornersMask(int radius) {
 	auto result = std::array<QImage, 4>();
 	const auto side = radius * style::DevicePixelRatio();
-	auto full = QImage(
-		QSize(side, side) * 3,
-		QImage::Format_ARGB32_Premultiplied);
-	full.fill(Qt::transparent);
-	{
-		QPainter p(&full);
-		PainterHighQualityEnabler hq(p);
-
-		p.setPen(Qt::NoPen);
-		p.setBrush(Qt::white);
-		p.drawRoundedRect(0, 0, side * 3, side * 3, side, side);
-	}
-	result[0] = full.copy(0, 0, side, side);
-	result[1] = full.copy(side * 2, 0, side, side);
-	result[2] = full.copy(0, side * 2, side, side);
-	result[3] = full.copy(side * 2, side * 2, side, side);
-	for (auto &image : result) {
+	const auto opacities = CornerOpacities(side);
+	for (auto i = 0; i != 4; ++i) {
+		const auto right = (i % 2) != 0;
+		const auto bottom = (i / 2) != 0;
+		auto &image = result[i];
+		image = QImage(side, side, QImage::Format_ARGB32_Premultiplied);
+		for (auto y = 0; y != side; ++y) {
+			const auto line = reinterpret_cast<uint32*>(image.scanLine(y));
+			const auto row = opacities.data()
+				+ (bottom ? (side - 1 - y) : y) * side;
+			for (auto x = 0; x != side; ++x) {
+				const auto opacity = uint32(row[right ? (side - 1 - x) : x]);
+				line[x] = (opacity << 24)
+					| (opacity << 16)
+					| (opacity << 8)
+					| opacity;
+			}
+		}
 		image.setDevicePixelRatio(style::DevicePixelRatio());
 	}
 	return result;
 }
 
+// Counter based generator, gives random shifts for eight pixels at once.
+[[nodiscard]] inline uint64 DitherRandom(uint64 seed, uint64 counter) {
+	auto z = seed + counter * 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
 template <int kBits> // 4 means 16x16, 3 means 8x8
 [[nodiscard]] QImage DitherGeneric(const QImage &image) {
 	static_assert(kBits >= 1 && kBits <= 4);
@@ -91,64 +778,100 @@ template <int kBits> // 4 means 16x16, 3 means 8x8
 
 	const auto width = image.width();
 	const auto height = image.height();
-	const auto area = width * height;
-	const auto shifts = std::make_unique<uchar[]>(area);
-	bytes::set_random(bytes::make_span(shifts.get(), area));
-
-	// shiftx = int(shift & kMask) - kShift;
-	// shifty = int((shift >> 4) & kMask) - kShift;
-	// Clamp shifts close to edges.
-	for (auto y = 0; y != kShift; ++y) {
-		const auto min = kShift - y;
-		const auto shifted = (min << 4);
-		auto shift = shifts.get() + y * width;
-		for (const auto till = shift + width; shift != till; ++shift) {
-			if (((*shift >> 4) & kMask) < min) {
-				*shift = shifted | (*shift & 0x0F);
-			}
-		}
-	}
-	for (auto y = height - (kShift - 1); y != height; ++y) {
-		const auto max = kShift + (height - y - 1);
-		const auto shifted = (max << 4);
-		auto shift = shifts.get() + y * width;
-		for (const auto till = shift + width; shift != till; ++shift) {
-			if (((*shift >> 4) & kMask) > max) {
-				*shift = shifted | (*shift & 0x0F);
-			}
-		}
-	}
-	for (auto shift = shifts.get(), ytill = shift + area
-		; shift != ytill
-		; shift += width - kShift) {
-		for (const auto till = shift + kShift; shift != till; ++shift) {
-			const auto min = (till - shift);
-			if ((*shift & kMask) < min) {
-				*shift = (*shift & 0xF0) | min;
-			}
-		}
-	}
-	for (auto shift = shifts.get(), ytill = shift + area; shift != ytill;) {
-		shift += width - (kShift - 1);
-		for (const auto till = shift + (kShift - 1); shift != till; ++shift) {
-			const auto max = kShift + (till - shift - 1);
-			if ((*shift & kMask) > max) {
-				*shift = (*shift & 0xF0) | max;
-			}
-		}
-	}
+
+	// Each pixel is taken from a random shift inside a square around it,
+	// a random byte gives the shift: shiftx = int(random & kMask) - kShift;
+	// shifty = int((random >> 4) & kMask) - kShift. Close to the edges the
+	// shifts are clamped to stay inside of the image.
+	auto seed = uint64();
+	bytes::set_random(bytes::make_span(&seed, 1));
+	const auto chunks = (width + 7) / 8;
 
 	auto result = image;
 	result.detach();
 
 	const auto src = reinterpret_cast<const uint32*>(image.constBits());
 	const auto dst = reinterpret_cast<uint32*>(result.bits());
-	for (auto index = 0; index != area; ++index) {
-		const auto shift = shifts[index];
-		const auto shiftx = int(shift & kMask) - kShift;
-		const auto shifty = int((shift >> 4) & kMask) - kShift;
-		dst[index] = src[index + (shifty * width) + shiftx];
-	}
+	const auto ditherRows = [&](int index) {
+		const auto from = index * kDitherRowsPerJob;
+		const auto till = std::min(from + kDitherRowsPerJob, height);
+		for (auto y = from; y != till; ++y) {
+			const auto line = y * width;
+			const auto counter = uint64(y) * chunks;
+			const auto minY = kShift - y;
+			const auto maxY = kShift + (height - y - 1);
+			const auto clamped = [&](int x) {
+				const auto random = DitherRandom(seed, counter + (x >> 3))
+					>> ((x & 7) * 8);
+				const auto shiftx = std::clamp(
+					int(random & kMask),
+					kShift - x,
+					kShift + (width - x - 1)) - kShift;
+				const auto shifty = std::clamp(
+					int((random >> 4) & kMask),
+					minY,
+					maxY) - kShift;
+				dst[line + x] = src[line + x + (shifty * width) + shiftx];
+			};
+			if (y < kShift || y >= height - (kShift - 1)) {
+				for (auto x = 0; x != width; ++x) {
+					clamped(x);
+				}
+				continue;
+			}
+
+			// Chunks of eight pixels from the second one to the last one
+			// that can't reach the right edge are shifted without clamps.
+			auto x = 0;
+			for (const auto first = std::min(8, width); x != first; ++x) {
+				clamped(x);
+			}
+			const auto base = line - kShift * width - kShift;
+			for (; x + 8 + (kShift - 1) <= width; x += 8) {
+				auto random = DitherRandom(seed, counter + (x >> 3));
+#if defined UI_SIMD_AVX2
+				const auto values = _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+					reinterpret_cast<const __m128i*>(&random)));
+				const auto mask = _mm256_set1_epi32(kMask);
+				const auto shiftx = _mm256_and_si256(values, mask);
+				const auto shifty = _mm256_and_si256(
+					_mm256_srli_epi32(values, 4),
+					mask);
+				const auto offsets = _mm256_add_epi32(
+					_mm256_add_epi32(
+						_mm256_set1_epi32(base + x),
+						_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)),
+					_mm256_add_epi32(
+						_mm256_mullo_epi32(
+							shifty,
+							_mm256_set1_epi32(width)),
+						shiftx));
+				_mm256_storeu_si256(
+					reinterpret_cast<__m256i*>(dst + line + x),
+					_mm256_i32gather_epi32(
+						reinterpret_cast<const int*>(src),
+						offsets,
+						4));
+#else // UI_SIMD_AVX2
+				for (auto i = 0; i != 8; ++i, random >>= 8) {
+					const auto shiftx = int(random & kMask);
+					const auto shifty = int((random >> 4) & kMask);
+					dst[line + x + i] = src[base
+						+ x
+						+ i
+						+ (shifty * width)
+						+ shiftx];
+				}
+#endif // UI_SIMD_AVX2
+			}
+			for (; x != width; ++x) {
+				clamped(x);
+			}
+		}
+	};
+	ParallelFor(
+		(height + kDitherRowsPerJob - 1) / kDitherRowsPerJob,
+		ditherRows);
 
 	return result;
 }
@@ -274,18 +997,232 @@ template <int kBits> // 4 means 16x16, 3 means 8x8
 	return result;
 }
 
+struct GradientKey {
+	std::array<uint32, 4> colors = { { 0 } };
+	int phase = 0;
+	int step = 0;
+	int width = 0;
+	int height = 0;
+
+	friend inline std::strong_ordering operator<=>(
+		const GradientKey &a,
+		const GradientKey &b) = default;
+	friend inline bool operator==(
+		const GradientKey &a,
+		const GradientKey &b) = default;
+};
+
+struct CachedGradient {
+	QImage image;
+	std::list<GradientKey>::iterator position;
+};
+
+struct GradientCache {
+	QMutex mutex;
+	base::flat_map<GradientKey, CachedGradient> images;
+	std::list<GradientKey> lru; // Most recent first.
+	int64 bytes = 0;
+};
+
+[[nodiscard]] GradientCache &Gradients() {
+	static auto Result = GradientCache();
+	return Result;
+}
+
+[[nodiscard]] QImage FindGradient(
+		GradientCache &cache,
+		const GradientKey &key) {
+	const auto i = cache.images.find(key);
+	if (i == end(cache.images)) {
+		return QImage();
+	}
+	cache.lru.splice(begin(cache.lru), cache.lru, i->second.position);
+	return i->second.image;
+}
+
+void RememberGradient(
+		GradientCache &cache,
+		const GradientKey &key,
+		const QImage &image) {
+	if (cache.images.contains(key)) {
+		return;
+	}
+	cache.lru.push_front(key);
+	cache.images.emplace(key, CachedGradient{ image, begin(cache.lru) });
+	cache.bytes += image.sizeInBytes();
+	while (cache.bytes > kGradientCacheBudget && cache.lru.size() > 1) {
+		const auto i = cache.images.find(cache.lru.back());
+		cache.bytes -= i->second.image.sizeInBytes();
+		cache.images.erase(i);
+		cache.lru.pop_back();
+	}
+}
+
+[[nodiscard]] QImage GradientKeyframe(
+		GradientKey key,
+		const std::vector<QColor> &colors,
+		int rotation,
+		int step) {
+	// Keyframes are kept at the small generated resolution.
+	key.step = step;
+	key.width = key.height = 0;
+
+	auto &cache = Gradients();
+	auto lock = QMutexLocker(&cache.mutex);
+	if (auto result = FindGradient(cache, key); !result.isNull()) {
+		return result;
+	}
+	lock.unlock();
+
+	auto result = GenerateSmallComplexGradient(
+		colors,
+		rotation,
+		step / float(kGradientProgressSteps));
+
+	lock.relock();
+	RememberGradient(cache, key, result);
+	return result;
+}
+
+[[nodiscard]] QImage BlendGradientKeyframes(
+		const QImage &from,
+		const QImage &to,
+		float progress) {
+	Expects(from.size() == to.size());
+	Expects(from.format() == QImage::Format_RGB32);
+	Expects(to.format() == QImage::Format_RGB32);
+
+	auto result = QImage(from.size(), QImage::Format_RGB32);
+	const auto alpha = uint32(base::SafeRound(progress * 256));
+	const auto count = from.width() * from.height();
+	auto a = reinterpret_cast<const uint32*>(from.constBits());
+	auto b = reinterpret_cast<const uint32*>(to.constBits());
+	auto pixels = reinterpret_cast<uint32*>(result.bits());
+	for (auto i = 0; i != count; ++i) {
+		const auto ag = (a[i] >> 8) & 0x00FF00FFU;
+		const auto arb = a[i] & 0x00FF00FFU;
+		const auto bg = (b[i] >> 8) & 0x00FF00FFU;
+		const auto brb = b[i] & 0x00FF00FFU;
+		const auto g = ((ag * (256 - alpha) + bg * alpha) >> 8) & 0x00FF00FFU;
+		const auto rb = ((arb * (256 - alpha) + brb * alpha) >> 8)
+			& 0x00FF00FFU;
+		pixels[i] = 0xFF000000U | (g << 8) | rb;
+	}
+	return result;
+}
+
 [[nodiscard]] QImage GenerateComplexGradient(
 		QSize size,
 		const std::vector<QColor> &colors,
 		int rotation,
 		float progress) {
-	auto exact = GenerateSmallComplexGradient(colors, rotation, progress);
-	return (exact.size() == size)
-		? exact
-		: exact.scaled(
+	auto key = GradientKey{
+		.phase = std::clamp(rotation, 0, 315) / 45,
+		.width = size.width(),
+		.height = size.height(),
+	};
+	for (auto i = 0, count = int(colors.size()); i != count; ++i) {
+		key.colors[i] = colors[i].rgba();
+	}
+	progress = std::clamp(progress, 0.f, 1.f);
+
+	// Only static gradients are cached at the target size. Animation
+	// frames are blended from small exact keyframes, generated for a fixed
+	// number of progress steps, and upscaled once on every call.
+	//
+	// Between the steps the result is a linear blend of the two nearest
+	// keyframes instead of the exact gradient for that progress, which
+	// differs from it by at most one unit per channel.
+	const auto animating = (progress > 0.f) && (progress < 1.f);
+	auto &cache = Gradients();
+	if (!animating) {
+		key.step = (progress > 0.f) ? kGradientProgressSteps : 0;
+		auto lock = QMutexLocker(&cache.mutex);
+		if (auto result = FindGradient(cache, key); !result.isNull()) {
+			return result;
+		}
+	}
+
+	const auto position = progress * kGradientProgressSteps;
+	const auto step = std::min(
+		int(position),
+		kGradientProgressSteps);
+	const auto fraction = position - step;
+	auto small = GradientKeyframe(key, colors, rotation, step);
+	if (animating && fraction * 256 >= 0.5f) {
+		small = BlendGradientKeyframes(
+			small,
+			GradientKeyframe(key, colors, rotation, step + 1),
+			fraction);
+	}
+	auto result = (small.size() == size)
+		? small
+		: small.scaled(
 			size,
 			Qt::IgnoreAspectRatio,
 			Qt::SmoothTransformation);
+	if (!animating) {
+		auto lock = QMutexLocker(&cache.mutex);
+		RememberGradient(cache, key, result);
+	}
+	return result;
+}
+
+struct SvgKey {
+	uint64 hash = 0;
+	int width = 0;
+	int height = 0;
+	QByteArray content;
+
+	friend inline bool operator<(const SvgKey &a, const SvgKey &b) {
+		return std::tie(a.hash, a.width, a.height, a.content)
+			< std::tie(b.hash, b.width, b.height, b.content);
+	}
+};
+
+struct CachedSvg {
+	QImage image;
+	std::list<SvgKey>::iterator position;
+};
+
+struct SvgCache {
+	QMutex mutex;
+	base::flat_map<SvgKey, CachedSvg> images;
+	std::list<SvgKey> lru; // Most recent first.
+	int64 bytes = 0;
+};
+
+[[nodiscard]] SvgCache &Svgs() {
+	static auto Result = SvgCache();
+	return Result;
+}
+
+[[nodiscard]] QImage LookupSvg(const SvgKey &key) {
+	auto &cache = Svgs();
+	auto lock = QMutexLocker(&cache.mutex);
+	const auto i = cache.images.find(key);
+	if (i == end(cache.images)) {
+		return QImage();
+	}
+	cache.lru.splice(begin(cache.lru), cache.lru, i->second.position);
+	return i->second.image;
+}
+
+void RememberSvg(const SvgKey &key, const QImage &image) {
+	auto &cache = Svgs();
+	auto lock = QMutexLocker(&cache.mutex);
+	if (cache.images.contains(key)) {
+		return;
+	}
+	cache.lru.push_front(key);
+	cache.images.emplace(key, CachedSvg{ image, begin(cache.lru) });
+	cache.bytes += image.sizeInBytes() + key.content.size();
+	while (cache.bytes > kSvgCacheBudget && cache.lru.size() > 1) {
+		const auto i = cache.images.find(cache.lru.back());
+		cache.bytes -= i->second.image.sizeInBytes() + i->first.content.size();
+		cache.images.erase(i);
+		cache.lru.pop_back();
+	}
 }
 
 } // namespace
@@ -318,20 +1255,65 @@ std::array<QImage, 4> PrepareCorners(
 }
 
 std::array<QImage, 4> CornersMask(int radius) {
-	return PrepareCornersMask(radius);
+	static auto Mutex = QMutex();
+	static auto Masks = base::flat_map<
+		std::pair<int, int>,
+		std::array<QImage, 4>>();
+
+	const auto key = std::make_pair(radius, style::DevicePixelRatio());
+	auto lock = QMutexLocker(&Mutex);
+	if (const auto i = Masks.find(key); i != end(Masks)) {
+		return i->second;
+	}
+	lock.unlock();
+
+	auto result = PrepareCornersMask(radius);
+
+	lock.relock();
+	Masks.emplace(key, result);
+	return result;
+}
+
+QImage ScaleDownByRatio(const QImage &image, int ratio, QRect source) {
+	Expects(ratio > 0 && ratio <= 256);
+	Expects(image.format() == QImage::Format_ARGB32_Premultiplied
+		|| image.format() == QImage::Format_RGB32);
+
+	if (source.isNull()) {
+		source = image.rect();
+	} else {
+		Assert(image.rect().contains(source));
+	}
+	Assert(!(source.width() % ratio) && !(source.height() % ratio));
+
+	const auto width = source.width() / ratio;
+	const auto height = source.height() / ratio;
+	auto result = QImage(width, height, image.format());
+	if (result.isNull()) {
+		return result;
+	}
+
+	// Vertical sums of up to 256 lines fit in 16 bits, so a whole row
+	// of ratio source lines is accumulated first and then reduced.
+	const auto count = source.width() * 4;
+	auto sums = std::vector<uint16>(count);
+	const auto stride = image.bytesPerLine();
+	auto from = image.constBits() + source.y() * stride + source.x() * 4;
+	for (auto y = 0; y != height; ++y) {
+		ranges::fill(sums, uint16(0));
+		for (auto i = 0; i != ratio; ++i, from += stride) {
+			AccumulateLine(from, sums.data(), count);
+		}
+		ReduceLine(sums.data(), result.scanLine(y), width, ratio);
+	}
+	return result;
 }
 
 QImage EllipseMask(QSize size, double ratio) {
 	size *= ratio;
 	auto result = QImage(size, QImage::Format_ARGB32_Premultiplied);
-	result.fill(Qt::transparent);
-
-	QPainter p(&result);
-	PainterHighQualityEnabler hq(p);
-	p.setBrush(Qt::white);
-	p.setPen(Qt::NoPen);
-	p.drawEllipse(QRect(QPoint(), size));
-	p.end();
+	result.fill(Qt::white);
+	EllipseInPlace(result, QRect(QPoint(), size));
 
 	result.setDevicePixelRatio(ratio);
 	return result;
@@ -360,25 +1342,64 @@ std::array<QImage, 4> PrepareCorners(
 	}
 	const auto guard = gsl::finally([&] { inflateEnd(&stream); });
 
-	auto result = QByteArray(kMaxGzipFileSize + 1, char(0));
+	// The gzip trailer ends with the unpacked size modulo 2^32, trust it
+	// if it fits the limit, otherwise grow the buffer by doubling.
+	const auto trailer = (bytes.size() >= 18)
+		? (uint32(uchar(bytes[bytes.size() - 4]))
+			| (uint32(uchar(bytes[bytes.size() - 3])) << 8)
+			| (uint32(uchar(bytes[bytes.size() - 2])) << 16)
+			| (uint32(uchar(bytes[bytes.size() - 1])) << 24))
+		: uint32();
+	const auto capacity = (trailer > 0 && trailer <= kMaxGzipFileSize)
+		? int(trailer + 1)
+		: std::clamp(
+			int(bytes.size()) * 4,
+			kMinGzipChunk,
+			kMaxGzipFileSize + 1);
+	auto result = QByteArray(capacity, Qt::Uninitialized);
+	auto written = 0;
 	stream.avail_in = bytes.size();
 	stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(bytes.data()));
-	stream.avail_out = 0;
-	while (!stream.avail_out) {
-		stream.avail_out = result.size();
-		stream.next_out = reinterpret_cast<Bytef*>(result.data());
+	while (true) {
+		stream.avail_out = result.size() - written;
+		stream.next_out = reinterpret_cast<Bytef*>(result.data() + written);
 		int res = inflate(&stream, Z_NO_FLUSH);
-		if (res != Z_OK && res != Z_STREAM_END) {
+		written = result.size() - stream.avail_out;
+		if (res == Z_STREAM_END) {
+			break;
+		} else if (res != Z_OK) {
 			return bytes;
-		} else if (!stream.avail_out) {
+		} else if (stream.avail_out) {
+			break;
+		} else if (result.size() > kMaxGzipFileSize) {
 			return bytes;
 		}
+		result.resize(std::min(
+			qsizetype(result.size()) * 2,
+			qsizetype(kMaxGzipFileSize) + 1));
+	}
+	if (written > kMaxGzipFileSize) {
+		return bytes;
 	}
-	result.resize(result.size() - stream.avail_out);
+	result.resize(written);
 	return result;
 }
 
 [[nodiscard]] ReadResult ReadGzipSvg(const ReadArgs &args) {
+	// The same stickers and patterns are read many times, remember
+	// the rasterized results by the packed content and the size limit.
+	const auto key = SvgKey{
+		.hash = XXH64(args.content.constData(), args.content.size(), 0),
+		.width = args.maxSize.width(),
+		.height = args.maxSize.height(),
+		.content = args.content,
+	};
+	if (auto image = LookupSvg(key); !image.isNull()) {
+		auto result = ReadResult();
+		result.image = std::move(image);
+		result.format = "svg";
+		return result;
+	}
 	const auto bytes = UnpackGzip(args.content);
 	if (bytes.isEmpty()) {
 		LOG(("Svg Error: Couldn't unpack gzip-ed content."));
@@ -408,10 +1429,27 @@ std::array<QImage, 4> PrepareCorners(
 		QPainter p(&result.image);
 		renderer.render(&p, QRect(QPoint(), size));
 	}
+	RememberSvg(key, result.image);
 	result.format = "svg";
 	return result;
 }
 
+// libjpeg can decode at 1/2, 1/4 or 1/8 of the size right away. Pick the
+// smallest of those still covering maxSize, Read() scales it precisely.
+[[nodiscard]] QSize JpegDecodeSize(QSize size, QSize maxSize) {
+	const auto fitted = size.scaled(maxSize, Qt::KeepAspectRatio);
+	auto denominator = 1;
+	while (denominator < 8
+		&& size.width() / (denominator * 2) >= fitted.width()
+		&& size.height() / (denominator * 2) >= fitted.height()) {
+		denominator *= 2;
+	}
+	const auto scale = [&](int value) {
+		return (value + denominator - 1) / denominator;
+	};
+	return QSize(scale(size.width()), scale(size.height()));
+}
+
 [[nodiscard]] ReadResult ReadOther(const ReadArgs &args) {
 	auto bytes = args.content;
 	if (bytes.isEmpty()) {
@@ -431,6 +1469,18 @@ std::array<QImage, 4> PrepareCorners(
 	result.format = reader.format().toLower();
 	result.animated = reader.supportsAnimation()
 		&& (reader.imageCount() > 1);
+	if (result.format == qstr("jpeg") && !args.maxSize.isEmpty()) {
+		// The scaled size applies before the EXIF orientation.
+		auto maxSize = args.maxSize;
+		const auto transformation = reader.transformation();
+		if (transformation & QImageIOHandler::TransformationRotate90) {
+			maxSize.transpose();
+		}
+		const auto decode = JpegDecodeSize(size, maxSize);
+		if (decode != size) {
+			reader.setScaledSize(decode);
+		}
+	}
 	if (!reader.read(&result.image) || result.image.isNull()) {
 		return {};
 	}
@@ -550,9 +1600,12 @@ QImage Blur(QImage &&image, bool ignoreAlpha) {
 
 	int x, y, i;
 
-	int yw = 0;
+	// The vectorized passes keep each channel sum in a 16 bit lane, the
+	// scalar ones pack them to uint64, the results are the same.
+	y = BlurRowsVectorized(pix, rgb, w, h, stride, radius);
+	int yw = y * stride;
 	const int we = w - r1;
-	for (y = 0; y < h; y++) {
+	for (; y < h; y++) {
 		uint64 cur = BlurGetColors(&pix[yw]);
 		uint64 rgballsum = -radius * cur;
 		uint64 rgbsum = cur * ((r1 * (r1 + 1)) >> 1);
@@ -587,7 +1640,8 @@ x++;
 	}
 
 	const int he = h - r1;
-	for (x = 0; x < w; x++) {
+	x = BlurColumnsVectorized(pix, rgb, w, h, stride, radius);
+	for (; x < w; x++) {
 		uint64 rgballsum = -radius * rgb[x];
 		uint64 rgbsum = rgb[x] * ((r1 * (r1 + 1)) >> 1);
 		for (i = 1; i <= radius; i++) {
@@ -641,202 +1695,84 @@ yi += stride;
 
 	const auto width_m1 = width - 1;
 	const auto height_m1 = height - 1;
-	const auto widthxheight = width * height;
-	const auto div = 2 * radius + 1;
 	const auto radius_p1 = radius + 1;
 	const auto divsum = radius_p1 * radius_p1;
 
-	const auto dvcount = 256 * divsum;
-	const auto buffers = (div * 3) // stack
-		+ std::max(width, height) // vmin
-		+ widthxheight * 3 // rgb
-		+ dvcount; // dv
-	auto storage = std::vector<int>(buffers);
-	auto taken = 0;
-	const auto take = [&](int size) {
-		const auto result = gsl::make_span(storage).subspan(taken, size);
-		taken += size;
-		return result;
-	};
-
-	// Small buffers
-	const auto stack = take(div * 3).data();
-	const auto vmin = take(std::max(width, height)).data();
-
-	// Large buffers
-	const auto rgb = take(widthxheight * 3).data();
-	const auto dvs = take(dvcount);
-
-	auto &&ints = ranges::views::ints;
-	for (auto &&[value, index] : ranges::views::zip(dvs, ints(0, ranges::unreachable))) {
-		value = (index / divsum);
+	auto dvs = std::vector<int>(256 * divsum);
+	for (auto i = 0, count = int(dvs.size()); i != count; ++i) {
+		dvs[i] = (i / divsum);
 	}
 	const auto dv = dvs.data();
 
-	// Variables
-	auto stackpointer = 0;
-	for (const auto x : ints(0, width)) {
-		vmin[x] = std::min(x + radius_p1, width_m1);
-	}
-	for (const auto y : ints(0, height)) {
-		auto rinsum = 0;
-		auto ginsum = 0;
-		auto binsum = 0;
-		auto routsum = 0;
-		auto goutsum = 0;
-		auto boutsum = 0;
-		auto rsum = 0;
-		auto gsum = 0;
-		auto bsum = 0;
-
-		const auto y_width = y * width;
-		for (const auto i : ints(-radius, radius + 1)) {
-			const auto sir = &stack[(i + radius) * 3];
-			const auto x = std::clamp(i, 0, width_m1);
-			const auto offset = (y_width + x) * 4;
-			sir[0] = pixels[offset];
-			sir[1] = pixels[offset + 1];
-			sir[2] = pixels[offset + 2];
-
-			const auto rbs = radius_p1 - std::abs(i);
-			rsum += sir[0] * rbs;
-			gsum += sir[1] * rbs;
-			bsum += sir[2] * rbs;
-
-			if (i > 0) {
-				rinsum += sir[0];
-				ginsum += sir[1];
-				binsum += sir[2];
-			} else {
-				routsum += sir[0];
-				goutsum += sir[1];
-				boutsum += sir[2];
+	// Horizontal pass result, three channels per pixel.
+	auto storage = std::vector<int>(width * height * 3);
+	const auto rgb = storage.data();
+
+	// The stack of the stack blur holds the clamped window samples,
+	// so instead of keeping it they are read from the source again.
+	// That makes rows and columns independent: rows are blurred in
+	// chunks and columns in strips, each strip going down row by row
+	// with contiguous reads and writes, in parallel.
+	const auto blurRows = [&](int index) {
+		const auto from = index * kBlurRowsPerJob;
+		const auto till = std::min(from + kBlurRowsPerJob, height);
+		for (auto y = from; y != till; ++y) {
+			const auto line = pixels + y * width * 4;
+			const auto sample = [&](int x) {
+				return line + std::clamp(x, 0, width_m1) * 4;
+			};
+			auto sums = BlurSums();
+			for (auto i = -radius; i <= radius; ++i) {
+				sums.add(sample(i), radius_p1 - std::abs(i), i > 0);
 			}
-		}
-		stackpointer = radius;
-
-		for (const auto x : ints(0, width)) {
-			const auto position = (y_width + x) * 3;
-			rgb[position] = dv[rsum];
-			rgb[position + 1] = dv[gsum];
-			rgb[position + 2] = dv[bsum];
-
-			rsum -= routsum;
-			gsum -= goutsum;
-			bsum -= boutsum;
-
-			const auto stackstart = (stackpointer - radius + div) % div;
-			const auto sir = &stack[stackstart * 3];
-
-			routsum -= sir[0];
-			goutsum -= sir[1];
-			boutsum -= sir[2];
-
-			const auto offset = (y_width + vmin[x]) * 4;
-			sir[0] = pixels[offset];
-			sir[1] = pixels[offset + 1];
-			sir[2] = pixels[offset + 2];
-			rinsum += sir[0];
-			ginsum += sir[1];
-			binsum += sir[2];
-
-			rsum += rinsum;
-			gsum += ginsum;
-			bsum += binsum;
-			{
-				stackpointer = (stackpointer + 1) % div;
-				const auto sir = &stack[stackpointer * 3];
-
-				routsum += sir[0];
-				goutsum += sir[1];
-				boutsum += sir[2];
-
-				rinsum -= sir[0];
-				ginsum -= sir[1];
-				binsum -= sir[2];
+			const auto out = rgb + y * width * 3;
+			for (auto x = 0; x != width; ++x) {
+				sums.step(
+					out + x * 3,
+					dv,
+					sample(x - radius),
+					sample(x + radius_p1),
+					sample(x + 1));
 			}
 		}
-	}
-
-	for (const auto y : ints(0, height)) {
-		vmin[y] = std::min(y + radius_p1, height_m1) * width;
-	}
-	for (const auto x : ints(0, width)) {
-		auto rinsum = 0;
-		auto ginsum = 0;
-		auto binsum = 0;
-		auto routsum = 0;
-		auto goutsum = 0;
-		auto boutsum = 0;
-		auto rsum = 0;
-		auto gsum = 0;
-		auto bsum = 0;
-		for (const auto i : ints(-radius, radius + 1)) {
-			const auto y = std::clamp(i, 0, height_m1);
-			const auto position = (y * width + x) * 3;
-			const auto sir = &stack[(i + radius) * 3];
-
-			sir[0] = rgb[position];
-			sir[1] = rgb[position + 1];
-			sir[2] = rgb[position + 2];
-
-			const auto rbs = radius_p1 - std::abs(i);
-			rsum += sir[0] * rbs;
-			gsum += sir[1] * rbs;
-			bsum += sir[2] * rbs;
-			if (i > 0) {
-				rinsum += sir[0];
-				ginsum += sir[1];
-				binsum += sir[2];
-			} else {
-				routsum += sir[0];
-				goutsum += sir[1];
-				boutsum += sir[2];
+	};
+	const auto blurColumns = [&](int index) {
+		const auto from = index * kBlurColumnsPerJob;
+		const auto till = std::min(from + kBlurColumnsPerJob, width);
+		auto sums = std::array<BlurSums, kBlurColumnsPerJob>();
+		const auto line = [&](int y) {
+			return rgb + std::clamp(y, 0, height_m1) * width * 3;
+		};
+		for (auto i = -radius; i <= radius; ++i) {
+			const auto samples = line(i);
+			for (auto x = from; x != till; ++x) {
+				sums[x - from].add(
+					samples + x * 3,
+					radius_p1 - std::abs(i),
+					i > 0);
 			}
 		}
-		stackpointer = radius;
-		for (const auto y : ints(0, height)) {
-			const auto offset = (y * width + x) * 4;
-			pixels[offset] = dv[rsum];
-			pixels[offset + 1] = dv[gsum];
-			pixels[offset + 2] = dv[bsum];
-			rsum -= routsum;
-			gsum -= goutsum;
-			bsum -= boutsum;
-
-			const auto stackstart = (stackpointer - radius + div) % div;
-			const auto sir = &stack[stackstart * 3];
-
-			routsum -= sir[0];
-			goutsum -= sir[1];
-			boutsum -= sir[2];
-
-			const auto position = (vmin[y] + x) * 3;
-			sir[0] = rgb[position];
-			sir[1] = rgb[position + 1];
-			sir[2] = rgb[position + 2];
-
-			rinsum += sir[0];
-			ginsum += sir[1];
-			binsum += sir[2];
-
-			rsum += rinsum;
-			gsum += ginsum;
-			bsum += binsum;
-			{
-				stackpointer = (stackpointer + 1) % div;
-				const auto sir = &stack[stackpointer * 3];
-
-				routsum += sir[0];
-				goutsum += sir[1];
-				boutsum += sir[2];
-
-				rinsum -= sir[0];
-				ginsum -= sir[1];
-				binsum -= sir[2];
+		for (auto y = 0; y != height; ++y) {
+			const auto out = pixels + y * width * 4;
+			const auto leaving = line(y - radius);
+			const auto entering = line(y + radius_p1);
+			const auto middle = line(y + 1);
+			for (auto x = from; x != till; ++x) {
+				sums[x - from].step(
+					out + x * 4,
+					dv,
+					leaving + x * 3,
+					entering + x * 3,
+					middle + x * 3);
 			}
 		}
-	}
+	};
+	ParallelFor(
+		(height + kBlurRowsPerJob - 1) / kBlurRowsPerJob,
+		blurRows);
+	ParallelFor(
+		(width + kBlurColumnsPerJob - 1) / kBlurColumnsPerJob,
+		blurColumns);
 	return std::move(image);
 }
 
@@ -988,14 +1924,7 @@ QImage Circle(QImage &&image, QRect target) {
 		QImage::Format_ARGB32_Premultiplied);
 	Assert(!image.isNull());
 
-	const auto ratio = image.devicePixelRatio();
-	auto p = QPainter(&image);
-	p.setCompositionMode(QPainter::CompositionMode_DestinationIn);
-	p.drawImage(
-		QRectF(target.topLeft() / ratio, target.size() / ratio),
-		EllipseMaskCached(target.size()));
-	p.end();
-
+	EllipseInPlace(image, target);
 	return std::move(image);
 }
 
@@ -1146,16 +2075,18 @@ QImage Colored(QImage &&image, QColor add) {
 		const auto ra = (0x100 - ca) * 0x100;
 		const auto w = image.width();
 		const auto h = image.height();
-		const auto add = image.bytesPerLine() - (w * 4);
+		const auto addPerLine = image.bytesPerLine() - (w * 4);
 		auto i = index_type();
 		for (auto y = 0; y != h; ++y) {
-			for (auto to = i + (w * 4); i != to; i += 4) {
+			const auto done = ColoredRowVectorized(pix + i, w, add);
+			i += done * 4;
+			for (auto to = i + ((w - done) * 4); i != to; i += 4) {
 				const auto a = pix[i + 3] + 1;
 				pix[i + 0] = (ra * pix[i + 0] + a * cb) >> 16;
 				pix[i + 1] = (ra * pix[i + 1] + a * cg) >> 16;
 				pix[i + 2] = (ra * pix[i + 2] + a * cr) >> 16;
 			}
-			i += add;
+			i += addPerLine;
 		}
 	}
 	return std::move(image);
@@ -1171,7 +2102,9 @@ QImage Opaque(QImage &&image) {
 		const auto height = image.height();
 		const auto addPerLine = (image.bytesPerLine() / sizeof(uint32)) - width;
 		for (auto y = 0; y != height; ++y) {
-			for (auto x = 0; x != width; ++x) {
+			const auto done = OpaqueRowVectorized(ints, width);
+			ints += done;
+			for (auto x = done; x != width; ++x) {
 				const auto components = anim::shifted(*ints);
 				*ints++ = anim::unshifted(components * 256
 					+ bg * (256 - anim::getAlpha(components)));
@@ -1182,12 +2115,61 @@ QImage Opaque(QImage &&image) {
 	return std::move(image);
 }
 
+// Same as drawing the image centered on a black or transparent canvas,
+// but without painting: the rows are copied and only the margins filled.
+[[nodiscard]] QImage PlaceCentered(
+		QImage &&image,
+		QSize outer,
+		int ratio,
+		Options options) {
+	image = std::move(image).convertToFormat(
+		QImage::Format_ARGB32_Premultiplied);
+	auto result = QImage(outer, QImage::Format_ARGB32_Premultiplied);
+	if (result.isNull()) {
+		return result;
+	}
+	result.setDevicePixelRatio(ratio);
+
+	// Drawing over opaque black keeps the colors and makes them opaque.
+	const auto background = (options & Option::TransparentBackground)
+		? uint32(0)
+		: uint32(0xFF000000U);
+	const auto left = ((outer.width() - image.width()) / (2 * ratio)) * ratio;
+	const auto top = ((outer.height() - image.height()) / (2 * ratio)) * ratio;
+	const auto copy = QRect(QPoint(left, top), image.size()).intersected(
+		QRect(QPoint(), outer));
+	const auto width = outer.width();
+	for (auto y = 0; y != outer.height(); ++y) {
+		const auto line = reinterpret_cast<uint32*>(result.scanLine(y));
+		if (y < copy.y() || y >= copy.y() + copy.height()) {
+			std::fill(line, line + width, background);
+			continue;
+		}
+		const auto from = copy.x();
+		const auto till = from + copy.width();
+		std::fill(line, line + from, background);
+		const auto source = reinterpret_cast<const uint32*>(
+			image.constScanLine(y - top)) + (from - left);
+		for (auto x = from; x != till; ++x) {
+			line[x] = source[x - from] | background;
+		}
+		std::fill(line + till, line + width, background);
+	}
+	return result;
+}
+
 QImage Prepare(QImage image, int w, int h, const PrepareArgs &args) {
 	Expects(!image.isNull());
 
+	const auto cancelled = [&] {
+		return args.token && args.token->cancelled();
+	};
 	if (args.options & Option::Blur) {
 		image = Blur(std::move(image));
 		Assert(!image.isNull());
+		if (cancelled()) {
+			return QImage();
+		}
 	}
 	if (w <= 0
 		|| (w == image.width() && (h <= 0 || h == image.height()))) {
@@ -1208,43 +2190,43 @@ QImage Prepare(QImage image, int w, int h, const PrepareArgs &args) {
 				: Qt::SmoothTransformation));
 		Assert(!image.isNull());
 	}
+	if (cancelled()) {
+		return QImage();
+	}
 	auto outer = args.outer;
 	if (!outer.isEmpty()) {
 		const auto ratio = style::DevicePixelRatio();
 		outer *= ratio;
 		if (outer != QSize(w, h)) {
-			image.setDevicePixelRatio(ratio);
-			auto result = QImage(outer, QImage::Format_ARGB32_Premultiplied);
-			result.setDevicePixelRatio(ratio);
-			if (args.options & Images::Option::TransparentBackground) {
-				result.fill(Qt::transparent);
-			}
-			{
-				QPainter p(&result);
-				if (!(args.options & Images::Option::TransparentBackground)) {
-					if (w < outer.width() || h < outer.height()) {
-						p.fillRect(
-							QRect({}, result.size() / ratio),
-							Qt::black);
-					}
-				}
-				p.drawImage(
-					(result.width() - image.width()) / (2 * ratio),
-					(result.height() - image.height()) / (2 * ratio),
-					image);
-			}
-			image = std::move(result);
+			image = PlaceCentered(
+				std::move(image),
+				outer,
+				ratio,
+				args.options);
 			Assert(!image.isNull());
 		}
 	}
+	if (cancelled()) {
+		return QImage();
+	}
 
-	if (args.options
-		& (Option::RoundCircle | Option::RoundLarge | Option::RoundSmall)) {
-		image = Round(std::move(image), args.options);
+	if (args.options & Option::RoundCircle) {
+		// The ellipse and the color are applied in one pass.
+		image = std::move(image).convertToFormat(
+			QImage::Format_ARGB32_Premultiplied);
 		Assert(!image.isNull());
-	}
-	if (args.colored) {
-		image = Colored(std::move(image), *args.colored);
+		EllipseInPlace(
+			image,
+			QRect(QPoint(), image.size()),
+			args.colored ? (*args.colored)->c : QColor());
+	} else {
+		if (args.options & (Option::RoundLarge | Option::RoundSmall)) {
+			image = Round(std::move(image), args.options);
+			Assert(!image.isNull());
+		}
+		if (args.colored) {
+			image = Colored(std::move(image), *args.colored);
+		}
 	}
 	image.setDevicePixelRatio(style::DevicePixelRatio());
 	return image;
@@ -1366,4 +2348,293 @@ QByteArray MakeProgressiveJpeg(const QByteArray &bytes) {
 	}
 }
 
+namespace {
+
+#ifdef JCS_EXTENSIONS
+// Lets libjpeg-turbo decode right into the QImage::Format_RGB32 layout.
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+constexpr auto kRgb32ColorSpace = JCS_EXT_BGRX;
+#else // Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+constexpr auto kRgb32ColorSpace = JCS_EXT_XRGB;
+#endif // Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+#endif // JCS_EXTENSIONS
+
+// Reads the orientation tag from the IFD0 of a saved APP1 EXIF marker.
+[[nodiscard]] int ExifOrientation(jpeg_saved_marker_ptr marker) {
+	constexpr auto kHeader = 6; // "Exif\0\0".
+	constexpr auto kOrientationTag = 0x0112;
+	for (; marker; marker = marker->next) {
+		const auto data = marker->data;
+		const auto size = int(marker->data_length);
+		if (marker->marker != JPEG_APP0 + 1
+			|| size < kHeader + 8
+			|| memcmp(data, "Exif\0\0", kHeader) != 0) {
+			continue;
+		}
+		const auto tiff = data + kHeader;
+		const auto length = size - kHeader;
+		const auto little = (tiff[0] == 'I' && tiff[1] == 'I');
+		if (!little && !(tiff[0] == 'M' && tiff[1] == 'M')) {
+			return 1;
+		}
+		const auto read16 = [&](int offset) {
+			return little
+				? (tiff[offset] | (tiff[offset + 1] << 8))
+				: ((tiff[offset] << 8) | tiff[offset + 1]);
+		};
+		const auto read32 = [&](int offset) {
+			return little
+				? (uint32(read16(offset)) | (uint32(read16(offset + 2)) << 16))
+				: ((uint32(read16(offset)) << 16) | uint32(read16(offset + 2)));
+		};
+		const auto ifd = read32(4);
+		if (ifd > uint32(length - 2)) {
+			return 1;
+		}
+		const auto count = read16(int(ifd));
+		for (auto i = 0; i != count; ++i) {
+			const auto entry = int(ifd) + 2 + i * 12;
+			if (entry + 12 > length) {
+				break;
+			} else if (read16(entry) == kOrientationTag) {
+				const auto value = read16(entry + 8);
+				return (value >= 1 && value <= 8) ? value : 1;
+			}
+		}
+		return 1;
+	}
+	return 1;
+}
+
+[[nodiscard]] QImage ApplyExifOrientation(QImage image, int orientation) {
+	const auto rotated = [&](int degrees) {
+		return image.transformed(QTransform().rotate(degrees));
+	};
+	switch (orientation) {
+	case 2: return image.mirrored(true, false);
+	case 3: return rotated(180);
+	case 4: return image.mirrored(false, true);
+	case 5: return rotated(90).mirrored(true, false);
+	case 6: return rotated(90);
+	case 7: return rotated(90).mirrored(false, true);
+	case 8: return rotated(270);
+	}
+	return image;
+}
+
+} // namespace
+
+struct ProgressiveJpegReader::Private {
+	enum class State {
+		Header,
+		Start,
+		Scans,
+		Finished,
+		Failed,
+	};
+
+	explicit Private(Fn<void(QImage, bool)> done);
+	~Private();
+
+	void append(const QByteArray &bytes);
+	void process();
+	bool show(int scan, bool final);
+
+	jpeg_decompress_struct info;
+	jpeg_error_mgr jerr;
+	jpeg_source_mgr source;
+	Fn<void(QImage, bool)> done;
+	QByteArray data;
+	QImage image;
+	QImage ready; // Passed to done() when feed() has finished the work.
+	bool readyFinal = false;
+	int64 skip = 0;
+	int completed = 0;
+	int shown = 0;
+	int orientation = 1;
+	State state = State::Header;
+};
+
+ProgressiveJpegReader::Private::Private(Fn<void(QImage, bool)> done)
+: done(std::move(done)) {
+	info.err = jpeg_std_error(&jerr);
+	jerr.error_exit = [](j_common_ptr cinfo) {
+		(*cinfo->err->output_message)(cinfo);
+		throw new std::exception;
+	};
+	jpeg_create_decompress(&info);
+	jpeg_save_markers(&info, JPEG_APP0 + 1, 0xFFFF);
+	info.client_data = this;
+
+	// Suspending source, all the not yet consumed bytes stay in data.
+	source.next_input_byte = nullptr;
+	source.bytes_in_buffer = 0;
+	source.init_source = [](j_decompress_ptr) {};
+	source.fill_input_buffer = [](j_decompress_ptr) -> boolean {
+		return FALSE;
+	};
+	source.skip_input_data = [](j_decompress_ptr cinfo, long count) {
+		if (count <= 0) {
+			return;
+		}
+		const auto that = static_cast<Private*>(cinfo->client_data);
+		const auto available = cinfo->src->bytes_in_buffer;
+		if (size_t(count) > available) {
+			that->skip += int64(count - available);
+			cinfo->src->next_input_byte += available;
+			cinfo->src->bytes_in_buffer = 0;
+		} else {
+			cinfo->src->next_input_byte += count;
+			cinfo->src->bytes_in_buffer -= count;
+		}
+	};
+	source.resync_to_restart = jpeg_resync_to_restart;
+	source.term_source = [](j_decompress_ptr) {};
+	info.src = &source;
+}
+
+ProgressiveJpegReader::Private::~Private() {
+	jpeg_destroy_decompress(&info);
+}
+
+void ProgressiveJpegReader::Private::append(const QByteArray &bytes) {
+	data.remove(0, data.size() - int(source.bytes_in_buffer));
+	const auto skipped = int(std::min(skip, int64(bytes.size())));
+	skip -= skipped;
+	data.append(bytes.constData() + skipped, bytes.size() - skipped);
+	source.next_input_byte = reinterpret_cast<const JOCTET*>(
+		data.constData());
+	source.bytes_in_buffer = data.size();
+}
+
+void ProgressiveJpegReader::Private::process() {
+	if (state == State::Header) {
+		if (jpeg_read_header(&info, TRUE) == JPEG_SUSPENDED) {
+			return;
+		}
+		const auto size = int64(info.image_width) * info.image_height;
+		if (!size || size > kReadMaxArea) {
+			state = State::Failed;
+			return;
+		}
+		switch (info.jpeg_color_space) {
+		case JCS_GRAYSCALE:
+			info.out_color_space = JCS_GRAYSCALE;
+			break;
+		case JCS_RGB:
+		case JCS_YCbCr:
+			info.out_color_space = JCS_RGB;
+			break;
+		default:
+			state = State::Failed;
+			return;
+		}
+#ifdef JCS_EXTENSIONS
+		info.out_color_space = kRgb32ColorSpace;
+#endif // JCS_EXTENSIONS
+		orientation = ExifOrientation(info.marker_list);
+		info.buffered_image = TRUE;
+		state = State::Start;
+	}
+	if (state == State::Start) {
+		if (!jpeg_start_decompress(&info)) {
+			return;
+		}
+#ifdef JCS_EXTENSIONS
+		const auto format = QImage::Format_RGB32;
+#else // JCS_EXTENSIONS
+		const auto format = (info.out_color_space == JCS_GRAYSCALE)
+			? QImage::Format_Grayscale8
+			: QImage::Format_RGB888;
+#endif // JCS_EXTENSIONS
+		image = QImage(info.output_width, info.output_height, format);
+		if (image.isNull()) {
+			state = State::Failed;
+			return;
+		}
+		state = State::Scans;
+	}
+	while (state == State::Scans) {
+		const auto status = jpeg_consume_input(&info);
+		if (status == JPEG_SUSPENDED) {
+			break;
+		} else if (status == JPEG_SCAN_COMPLETED) {
+			completed = info.input_scan_number;
+		} else if (status == JPEG_REACHED_EOI) {
+			completed = info.input_scan_number;
+			if (show(completed, true)) {
+				jpeg_finish_decompress(&info);
+				state = State::Finished;
+			}
+			return;
+		}
+	}
+	// Show only the last of the scans that came in this piece of content,
+	// once the next one has started, so that no more input is required.
+	if (completed > shown && completed < info.input_scan_number) {
+		show(completed, false);
+	}
+}
+
+bool ProgressiveJpegReader::Private::show(int scan, bool final) {
+	if (scan > shown) {
+		jpeg_start_output(&info, scan);
+		while (info.output_scanline < info.output_height) {
+			auto row = static_cast<JSAMPROW>(
+				image.scanLine(info.output_scanline));
+			if (jpeg_read_scanlines(&info, &row, 1) != 1) {
+				state = State::Failed;
+				return false;
+			}
+		}
+		jpeg_finish_output(&info);
+		shown = scan;
+	}
+#ifdef JCS_EXTENSIONS
+	// Shares the pixels, the next scan copies them only if they are kept.
+	auto result = image;
+#else // JCS_EXTENSIONS
+	auto result = image.convertToFormat(QImage::Format_RGB32);
+#endif // JCS_EXTENSIONS
+	ready = ApplyExifOrientation(std::move(result), orientation);
+	readyFinal = final;
+	return true;
+}
+
+ProgressiveJpegReader::ProgressiveJpegReader(
+	Fn<void(QImage image, bool final)> done)
+: _private(std::make_unique<Private>(std::move(done))) {
+}
+
+ProgressiveJpegReader::~ProgressiveJpegReader() = default;
+
+bool ProgressiveJpegReader::feed(const QByteArray &bytes) {
+	using State = Private::State;
+	if (_private->state == State::Failed) {
+		return false;
+	} else if (_private->state == State::Finished) {
+		return true;
+	}
+	try {
+		_private->append(bytes);
+		_private->process();
+	} catch (...) {
+		_private->state = State::Failed;
+	}
+	const auto result = (_private->state != State::Failed);
+	if (_private->ready.isNull()) {
+		return result;
+	}
+
+	// The callback may destroy the reader, so nothing is accessed after it.
+	const auto done = _private->done;
+	const auto final = _private->readyFinal;
+	done(base::take(_private->ready), final);
+	return result;
+}
+
+bool ProgressiveJpegReader::finished() const {
+	return (_private->state == Private::State::Finished);
+}
+
 } // namespace Images
@@ -25,7 +25,18 @@ enum class ImageRoundRadius {
 
 namespace Images {
 
+class JobToken;
+
 [[nodiscard]] QPixmap PixmapFast(QImage &&image);
+
+// Averages ratio x ratio blocks of the source rect pixels, its size must be
+// divisible by ratio. It is an exact box filter, like the area averaging
+// done by Qt::SmoothTransformation when downscaling, and differs from it
+// by at most 1 in each channel (only rounding is done differently).
+[[nodiscard]] QImage ScaleDownByRatio(
+	const QImage &image,
+	int ratio,
+	QRect source = QRect());
 [[nodiscard]] QImage BlurLargeImage(QImage &&image, int radius);
 [[nodiscard]] QImage DitherImage(const QImage &image);
 
@@ -176,6 +187,9 @@ struct PrepareArgs {
 	Options options;
 	QSize outer;
 
+	// Checked between the passes, a null image is returned if cancelled.
+	const JobToken *token = nullptr;
+
 	[[nodiscard]] PrepareArgs blurred() const {
 		auto result = *this;
 		result.options |= Option::Blur;
@@ -206,4 +220,25 @@ struct PrepareArgs {
 [[nodiscard]] bool IsProgressiveJpeg(const QByteArray &bytes);
 [[nodiscard]] QByteArray MakeProgressiveJpeg(const QByteArray &bytes);
 
+// Decodes a JPEG while its content arrives. For a progressive JPEG the
+// callback gets a refined image after each complete scan, with final
+// set for the last one, for a baseline JPEG only the final image.
+// EXIF orientation is applied to each of them. The callback is called
+// at the end of feed(), so it is allowed to destroy the reader.
+class ProgressiveJpegReader final {
+public:
+	explicit ProgressiveJpegReader(Fn<void(QImage image, bool final)> done);
+	~ProgressiveJpegReader();
+
+	// Returns false if the content can't be decoded this way.
+	bool feed(const QByteArray &bytes);
+	[[nodiscard]] bool finished() const;
+
+private:
+	struct Private;
+
+	const std::unique_ptr<Private> _private;
+
+};
+
 } // namespace Images
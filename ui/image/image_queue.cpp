@@ -0,0 +1,273 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#include "ui/image/image_queue.h"
+
+#include "ui/image/image_prepare.h"
+#include "base/flat_map.h"
+
+#include <QtCore/QMutex>
+
+#include <crl/crl_async.h>
+#include <crl/crl_on_main.h>
+
+#include <deque>
+#include <thread>
+
+namespace Images {
+namespace {
+
+struct Job {
+	QString key;
+	JobPriority priority = JobPriority::Normal;
+	Fn<QImage(const JobToken &token)> method;
+	std::shared_ptr<std::atomic<bool>> cancelled;
+	base::flat_map<uint64, Fn<void(QImage image)>> receivers;
+	crl::time queued = 0;
+	bool running = false;
+	bool finished = false;
+};
+
+class Queue final {
+public:
+	[[nodiscard]] rpl::lifetime enqueue(
+		JobPriority priority,
+		const QString &key,
+		Fn<QImage(const JobToken &token)> method,
+		Fn<void(QImage image)> done);
+	[[nodiscard]] JobQueueStats stats();
+
+private:
+	[[nodiscard]] std::shared_ptr<Job> takeNext();
+	void unqueue(const std::shared_ptr<Job> &job);
+	void forget(const std::shared_ptr<Job> &job);
+	void remove(const std::weak_ptr<Job> &weak, uint64 id);
+	void deliver(const std::shared_ptr<Job> &job, QImage image);
+	void work();
+
+	QMutex _mutex;
+	std::array<std::deque<std::shared_ptr<Job>>, kJobPriorityCount> _queued;
+	base::flat_map<QString, std::shared_ptr<Job>> _inFlight;
+	uint64 _lastReceiverId = 0;
+	int _workers = 0;
+	int _running = 0;
+	int64 _started = 0;
+	int64 _ran = 0;
+	int64 _finished = 0;
+	int64 _cancelled = 0;
+	crl::time _waitTotal = 0;
+	crl::time _runTotal = 0;
+	crl::time _maxWait = 0;
+
+};
+
+[[nodiscard]] int MaxWorkers() {
+	return std::max(int(std::thread::hardware_concurrency()), 2) - 1;
+}
+
+[[nodiscard]] Queue &Instance() {
+	static auto result = Queue();
+	return result;
+}
+
+rpl::lifetime Queue::enqueue(
+		JobPriority priority,
+		const QString &key,
+		Fn<QImage(const JobToken &token)> method,
+		Fn<void(QImage image)> done) {
+	Expects(method != nullptr);
+	Expects(done != nullptr);
+
+	auto lock = QMutexLocker(&_mutex);
+	const auto id = ++_lastReceiverId;
+	if (!key.isEmpty()) {
+		const auto i = _inFlight.find(key);
+		if (i != end(_inFlight)) {
+			const auto job = i->second;
+			job->receivers.emplace(id, std::move(done));
+			if (!job->running && priority < job->priority) {
+				unqueue(job);
+				job->priority = priority;
+				_queued[int(priority)].push_back(job);
+			}
+			return rpl::lifetime([=, weak = std::weak_ptr<Job>(job)] {
+				remove(weak, id);
+			});
+		}
+	}
+	const auto job = std::make_shared<Job>(Job{
+		.key = key,
+		.priority = priority,
+		.method = std::move(method),
+		.cancelled = std::make_shared<std::atomic<bool>>(false),
+		.queued = crl::now(),
+	});
+	job->receivers.emplace(id, std::move(done));
+	_queued[int(priority)].push_back(job);
+	if (!key.isEmpty()) {
+		_inFlight.emplace(key, job);
+	}
+	if (_workers < MaxWorkers()) {
+		++_workers;
+		crl::async([=] { work(); });
+	}
+	return rpl::lifetime([=, weak = std::weak_ptr<Job>(job)] {
+		remove(weak, id);
+	});
+}
+
+JobQueueStats Queue::stats() {
+	auto lock = QMutexLocker(&_mutex);
+	auto result = JobQueueStats{
+		.running = _running,
+		.finished = _finished,
+		.cancelled = _cancelled,
+		.averageWait = _started ? (_waitTotal / _started) : 0,
+		.averageRun = _ran ? (_runTotal / _ran) : 0,
+		.maxWait = _maxWait,
+	};
+	for (auto i = 0; i != kJobPriorityCount; ++i) {
+		result.queued[i] = int(_queued[i].size());
+	}
+	return result;
+}
+
+std::shared_ptr<Job> Queue::takeNext() {
+	for (auto &queued : _queued) {
+		if (!queued.empty()) {
+			auto result = std::move(queued.front());
+			queued.pop_front();
+			return result;
+		}
+	}
+	return nullptr;
+}
+
+void Queue::unqueue(const std::shared_ptr<Job> &job) {
+	auto &queued = _queued[int(job->priority)];
+	queued.erase(ranges::remove(queued, job), end(queued));
+}
+
+void Queue::forget(const std::shared_ptr<Job> &job) {
+	if (job->key.isEmpty()) {
+		return;
+	}
+	const auto i = _inFlight.find(job->key);
+	if (i != end(_inFlight) && i->second == job) {
+		_inFlight.erase(i);
+	}
+}
+
+void Queue::remove(const std::weak_ptr<Job> &weak, uint64 id) {
+	const auto job = weak.lock();
+	if (!job) {
+		return;
+	}
+	auto lock = QMutexLocker(&_mutex);
+	const auto i = job->receivers.find(id);
+	if (job->finished || i == end(job->receivers)) {
+		return;
+	}
+	job->receivers.erase(i);
+	if (!job->receivers.empty()) {
+		return;
+	}
+	*job->cancelled = true;
+	forget(job);
+	if (!job->running) {
+		unqueue(job);
+		job->finished = true;
+		++_cancelled;
+	}
+}
+
+void Queue::deliver(const std::shared_ptr<Job> &job, QImage image) {
+	auto lock = QMutexLocker(&_mutex);
+	forget(job);
+	job->finished = true;
+	if (*job->cancelled) {
+		++_cancelled;
+		return;
+	}
+	++_finished;
+	const auto receivers = base::take(job->receivers);
+	lock.unlock();
+
+	for (const auto &[id, done] : receivers) {
+		done(image);
+	}
+}
+
+void Queue::work() {
+	auto lock = QMutexLocker(&_mutex);
+	while (const auto job = takeNext()) {
+		const auto started = crl::now();
+		const auto wait = started - job->queued;
+		job->running = true;
+		++_running;
+		++_started;
+		_waitTotal += wait;
+		_maxWait = std::max(_maxWait, wait);
+		lock.unlock();
+
+		auto image = *job->cancelled
+			? QImage()
+			: job->method(JobToken(job->cancelled));
+
+		lock.relock();
+		--_running;
+		++_ran;
+		_runTotal += crl::now() - started;
+		crl::on_main([=, image = std::move(image)]() mutable {
+			Instance().deliver(job, std::move(image));
+		});
+	}
+	--_workers;
+}
+
+} // namespace
+
+JobToken::JobToken(std::shared_ptr<std::atomic<bool>> cancelled)
+: _cancelled(std::move(cancelled)) {
+}
+
+bool JobToken::cancelled() const {
+	return _cancelled->load(std::memory_order_relaxed);
+}
+
+rpl::lifetime EnqueueJob(
+		JobPriority priority,
+		const QString &key,
+		Fn<QImage(const JobToken &token)> method,
+		Fn<void(QImage image)> done) {
+	return Instance().enqueue(
+		priority,
+		key,
+		std::move(method),
+		std::move(done));
+}
+
+rpl::lifetime EnqueuePrepare(
+		JobPriority priority,
+		const QString &key,
+		QImage image,
+		QSize size,
+		const PrepareArgs &args,
+		Fn<void(QImage image)> done) {
+	Expects(!image.isNull());
+
+	return EnqueueJob(priority, key, [=](const JobToken &token) {
+		auto copy = args;
+		copy.token = &token;
+		return Prepare(image, size, copy);
+	}, std::move(done));
+}
+
+JobQueueStats QueueStats() {
+	return Instance().stats();
+}
+
+} // namespace Images
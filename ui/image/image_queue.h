@@ -0,0 +1,73 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#pragma once
+
+#include "base/basic_types.h"
+
+#include <QtGui/QImage>
+
+#include <crl/crl_time.h>
+#include <rpl/lifetime.h>
+
+#include <array>
+#include <atomic>
+
+namespace Images {
+
+struct PrepareArgs;
+
+enum class JobPriority : uchar {
+	Visible,
+	Normal,
+	Prefetch,
+};
+inline constexpr auto kJobPriorityCount = 3;
+
+// Passed to the job method, long jobs should check it between passes.
+class JobToken final {
+public:
+	explicit JobToken(std::shared_ptr<std::atomic<bool>> cancelled);
+
+	[[nodiscard]] bool cancelled() const;
+
+private:
+	const std::shared_ptr<std::atomic<bool>> _cancelled;
+
+};
+
+struct JobQueueStats {
+	std::array<int, kJobPriorityCount> queued = {};
+	int running = 0;
+	int64 finished = 0;
+	int64 cancelled = 0;
+	crl::time averageWait = 0;
+	crl::time averageRun = 0;
+	crl::time maxWait = 0;
+};
+
+// The method runs on a background thread, the done callback is called
+// on the main thread. Jobs with the same non-empty key share a single run
+// while one of them is in flight. The job is cancelled when all lifetimes
+// of its requests are destroyed before it is done.
+[[nodiscard]] rpl::lifetime EnqueueJob(
+	JobPriority priority,
+	const QString &key,
+	Fn<QImage(const JobToken &token)> method,
+	Fn<void(QImage image)> done);
+
+// Runs Prepare() as a job, the passes are skipped once it is cancelled.
+[[nodiscard]] rpl::lifetime EnqueuePrepare(
+	JobPriority priority,
+	const QString &key,
+	QImage image,
+	QSize size,
+	const PrepareArgs &args,
+	Fn<void(QImage image)> done);
+
+[[nodiscard]] JobQueueStats QueueStats();
+
+} // namespace Images
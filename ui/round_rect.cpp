@@ -77,20 +77,30 @@ RoundRect::RoundRect(
 	ImageRoundRadius radius,
 	const style::color &color)
 : _color(color)
-, _refresh([=] { _corners = Images::PrepareCorners(radius, _color); }) {
+, _refresh([=] {
+	_corners = Images::PrepareCorners(radius, _color);
+	_paletteVersion = style::PaletteVersion();
+}) {
 	_refresh();
 	style::PaletteChanged(
-	) | rpl::start_with_next(_refresh, _lifetime);
+	) | rpl::filter([=] {
+		return style::PaletteColorChanged(_color, _paletteVersion);
+	}) | rpl::start_with_next(_refresh, _lifetime);
 }
 
 RoundRect::RoundRect(
 	int radius,
 	const style::color &color)
 : _color(color)
-, _refresh([=] { _corners = Images::PrepareCorners(radius, _color); }) {
+, _refresh([=] {
+	_corners = Images::PrepareCorners(radius, _color);
+	_paletteVersion = style::PaletteVersion();
+}) {
 	_refresh();
 	style::PaletteChanged(
-	) | rpl::start_with_next(_refresh, _lifetime);
+	) | rpl::filter([=] {
+		return style::PaletteColorChanged(_color, _paletteVersion);
+	}) | rpl::start_with_next(_refresh, _lifetime);
 }
 
 void RoundRect::setColor(const style::color &color) {
@@ -41,6 +41,7 @@ private:
 	style::color _color;
 	std::array<QImage, 4> _corners;
 	Fn<void()> _refresh;
+	int _paletteVersion = 0;
 
 	rpl::lifetime _lifetime;
 
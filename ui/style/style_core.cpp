@@ -8,6 +8,8 @@
 
 #include "ui/effects/animation_value.h"
 #include "ui/painter.h"
+#include "ui/ui_simd.h"
+#include "base/options.h"
 #include "styles/style_basic.h"
 #include "styles/palette.h"
 
@@ -29,15 +31,176 @@ auto PaletteVersion = 0;
 auto ShortAnimationRunning = rpl::variable<bool>(false);
 auto RunningShortAnimations = 0;
 
+#if defined UI_SIMD_AVX2_DISPATCH
+// The AVX2 part of ColorizeVectorized(), see it for the details.
+UI_SIMD_AVX2_TARGET int ColorizeAvx2(
+		const uchar *mask,
+		const uchar *pixels,
+		int maskBytesPerPixel,
+		int maskOffset,
+		uint32 *result,
+		int width,
+		uint32 rb,
+		uint32 ag) {
+	const auto shift = _mm_cvtsi32_si128(maskOffset * 8);
+	const auto one = _mm256_set1_epi32(1);
+	const auto low = _mm256_set1_epi32(0xFF);
+	const auto high = _mm256_set1_epi32(int(0xFF00FF00U));
+	const auto blueRed = _mm256_set1_epi32(int(rb));
+	const auto greenAlpha = _mm256_set1_epi32(int(ag));
+	auto x = 0;
+	for (; x + 8 <= width; x += 8) {
+		const auto values = (maskBytesPerPixel == 1)
+			? _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+				reinterpret_cast<const __m128i*>(mask + x)))
+			: _mm256_and_si256(
+				_mm256_srl_epi32(
+					_mm256_loadu_si256(reinterpret_cast<const __m256i*>(
+						pixels + x * 4)),
+					shift),
+				low);
+		const auto opacity = _mm256_add_epi32(values, one);
+		const auto multiplier = _mm256_or_si256(
+			opacity,
+			_mm256_slli_epi32(opacity, 16));
+		_mm256_storeu_si256(
+			reinterpret_cast<__m256i*>(result + x),
+			_mm256_or_si256(
+				_mm256_srli_epi16(
+					_mm256_mullo_epi16(blueRed, multiplier),
+					8),
+				_mm256_and_si256(
+					_mm256_mullo_epi16(greenAlpha, multiplier),
+					high)));
+	}
+	return x;
+}
+#endif // UI_SIMD_AVX2_DISPATCH
+
+// Part of colorizeImage() for 8 bit masks and for one byte of 32 bit masks,
+// gives the same pixels as anim::unshifted(pattern * (mask + 1)). The blue
+// and red, green and alpha channels of the premultiplied color are kept in
+// 16 bit lanes, so one 16 bit multiply colorizes two channels at once.
+// Returns the pixels count done.
+int ColorizeVectorized(
+		const uchar *mask,
+		int maskBytesPerPixel,
+		int maskOffset,
+		uint32 *result,
+		int width,
+		uint32 premultiplied) {
+	if (maskBytesPerPixel != 1 && maskBytesPerPixel != 4) {
+		return 0;
+	}
+	const auto pixels = mask - maskOffset;
+	const auto rb = premultiplied & 0x00FF00FFU;
+	const auto ag = (premultiplied >> 8) & 0x00FF00FFU;
+	auto x = 0;
+#if defined UI_SIMD_AVX2_DISPATCH
+	if (Ui::SimdHasAvx2()) {
+		x = ColorizeAvx2(
+			mask,
+			pixels,
+			maskBytesPerPixel,
+			maskOffset,
+			result,
+			width,
+			rb,
+			ag);
+	}
+#endif // UI_SIMD_AVX2_DISPATCH
+#if defined UI_SIMD_SSE2
+	const auto shift = _mm_cvtsi32_si128(maskOffset * 8);
+	const auto zero = _mm_setzero_si128();
+	const auto one = _mm_set1_epi32(1);
+	const auto low = _mm_set1_epi32(0xFF);
+	const auto high = _mm_set1_epi32(int(0xFF00FF00U));
+	const auto blueRed = _mm_set1_epi32(int(rb));
+	const auto greenAlpha = _mm_set1_epi32(int(ag));
+	for (; x + 4 <= width; x += 4) {
+		auto values = __m128i();
+		if (maskBytesPerPixel == 1) {
+			auto bytes = int();
+			memcpy(&bytes, mask + x, sizeof(bytes));
+			values = _mm_unpacklo_epi16(
+				_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero),
+				zero);
+		} else {
+			values = _mm_and_si128(
+				_mm_srl_epi32(
+					_mm_loadu_si128(reinterpret_cast<const __m128i*>(
+						pixels + x * 4)),
+					shift),
+				low);
+		}
+		const auto opacity = _mm_add_epi32(values, one);
+		const auto multiplier = _mm_or_si128(
+			opacity,
+			_mm_slli_epi32(opacity, 16));
+		_mm_storeu_si128(
+			reinterpret_cast<__m128i*>(result + x),
+			_mm_or_si128(
+				_mm_srli_epi16(_mm_mullo_epi16(blueRed, multiplier), 8),
+				_mm_and_si128(_mm_mullo_epi16(greenAlpha, multiplier), high)));
+	}
+#elif defined UI_SIMD_NEON
+	const auto shift = vdupq_n_s32(-maskOffset * 8);
+	const auto one = vdupq_n_u32(1);
+	const auto low = vdupq_n_u32(0xFF);
+	const auto high = vdupq_n_u32(0xFF00FF00U);
+	const auto blueRed = vreinterpretq_u16_u32(vdupq_n_u32(rb));
+	const auto greenAlpha = vreinterpretq_u16_u32(vdupq_n_u32(ag));
+	for (; x + 4 <= width; x += 4) {
+		auto values = uint32x4_t();
+		if (maskBytesPerPixel == 1) {
+			auto bytes = uint32_t();
+			memcpy(&bytes, mask + x, sizeof(bytes));
+			values = vmovl_u16(vget_low_u16(
+				vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(bytes)))));
+		} else {
+			values = vandq_u32(
+				vshlq_u32(
+					vld1q_u32(reinterpret_cast<const uint32_t*>(
+						pixels + x * 4)),
+					shift),
+				low);
+		}
+		const auto opacity = vaddq_u32(values, one);
+		const auto multiplier = vreinterpretq_u16_u32(
+			vorrq_u32(opacity, vshlq_n_u32(opacity, 16)));
+		vst1q_u32(
+			reinterpret_cast<uint32_t*>(result + x),
+			vorrq_u32(
+				vreinterpretq_u32_u16(
+					vshrq_n_u16(vmulq_u16(blueRed, multiplier), 8)),
+				vandq_u32(
+					vreinterpretq_u32_u16(vmulq_u16(greenAlpha, multiplier)),
+					high)));
+	}
+#endif // UI_SIMD_SSE2 || UI_SIMD_NEON
+	return x;
+}
+
 std::vector<internal::ModuleBase*> &StyleModules() {
 	static auto result = std::vector<internal::ModuleBase*>();
 	return result;
 }
 
+base::options::toggle PrepareIconMasksOption({
+	.id = kOptionPrepareIconMasks,
+	.name = "Prepare icons in background",
+	.description = "Decode all icons on several threads at startup"
+		" and keep them in a cache on disk for the next launches.",
+	.restartRequired = true,
+});
+
 void startModules(int scale) {
 	for (const auto module : StyleModules()) {
 		module->start(scale);
 	}
+	if (PrepareIconMasksOption.value()) {
+		prepareIconMasks();
+	}
 }
 
 } // namespace
@@ -60,6 +223,8 @@ void StopShortAnimation() {
 
 } // namespace internal
 
+const char kOptionPrepareIconMasks[] = "prepare-icon-masks";
+
 void startManager(int scale) {
 	internal::registerFontFamily("Open Sans");
 	internal::startModules(scale);
@@ -79,6 +244,7 @@ int PaletteVersion() {
 }
 
 void NotifyPaletteChanged() {
+	internal::ApplyPaletteChanges();
 	++internal::PaletteVersion;
 	internal::PaletteChanges.fire({});
 }
@@ -129,8 +295,18 @@ void colorizeImage(
 		+ (useAlpha ? 3 : 0);
 	Assert(maskBytesAdded >= 0);
 	Assert(src.depth() == (maskBytesPerPixel << 3));
+	const auto premultiplied = anim::getPremultiplied(color);
 	for (int y = 0; y != height; ++y) {
-		for (int x = 0; x != width; ++x) {
+		const auto done = internal::ColorizeVectorized(
+			maskBytes,
+			maskBytesPerPixel,
+			useAlpha ? 3 : 0,
+			resultInts,
+			width,
+			premultiplied);
+		maskBytes += done * maskBytesPerPixel;
+		resultInts += done;
+		for (int x = done; x != width; ++x) {
 			auto maskOpacity = static_cast<anim::ShiftedMultiplier>(*maskBytes) + 1;
 			*resultInts = anim::unshifted(pattern * maskOpacity);
 			maskBytes += maskBytesPerPixel;
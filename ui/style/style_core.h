@@ -33,8 +33,13 @@ void EnsureContrast(ColorData &over, const ColorData &under);
 void StartShortAnimation();
 void StopShortAnimation();
 
+// Resets the icons painted with the main palette colors changed so far.
+void ApplyPaletteChanges();
+
 } // namespace internal
 
+extern const char kOptionPrepareIconMasks[];
+
 void startManager(int scale);
 void stopManager();
 
@@ -42,6 +47,13 @@ void stopManager();
 [[nodiscard]] int PaletteVersion();
 void NotifyPaletteChanged();
 
+// Whether the color was changed after the PaletteVersion() value, so that
+// caches depending only on unchanged colors can be kept. Colors that are
+// not from the main palette (owned or complex ones) count as changed by
+// each NotifyPaletteChanged(), that is for any sinceVersion that is less
+// than the current PaletteVersion().
+[[nodiscard]] bool PaletteColorChanged(const color &c, int sinceVersion);
+
 [[nodiscard]] rpl::producer<bool> ShortAnimationPlaying();
 
 // *outResult must be r.width() x r.height(), ARGB32_Premultiplied.
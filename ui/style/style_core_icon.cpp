@@ -8,25 +8,67 @@
 
 #include "ui/style/style_core_palette.h"
 #include "ui/style/style_core.h"
+#include "ui/integration.h"
 #include "base/basic_types.h"
+#include "base/debug_log.h"
 
+#include <QtCore/QDir>
+#include <QtCore/QFileInfo>
 #include <QtCore/QMutex>
+#include <QtCore/QSaveFile>
 #include <QtGui/QPainter>
 
+#include <crl/crl_async.h>
+#include <xxhash.h>
+
+#include <atomic>
+#include <list>
+#include <thread>
+
 namespace style {
 namespace internal {
 namespace {
 
+constexpr auto kColorizedCacheBudget = 4 * 1024 * 1024;
+constexpr auto kIconMasksCacheVersion = 2;
+constexpr auto kIconMasksHeaderSize = 6 * sizeof(uint32);
+constexpr auto kIconMasksEntrySize = 9 * sizeof(uint32);
+
 uint32 colorKey(QColor c) {
 	return (((((uint32(c.red()) << 8) | uint32(c.green())) << 8) | uint32(c.blue())) << 8) | uint32(c.alpha());
 }
 
 base::flat_map<const IconMask*, QImage> IconMasks;
+base::flat_map<const IconMask*, uint64> IconMasksUnchecked; // From cache.
 QMutex IconMasksMutex;
+int IconMasksGeneration = 0; // Changes when IconMasks are destroyed.
 
 base::flat_map<QPair<const IconMask*, uint32>, QPixmap> iconPixmaps;
+base::flat_map<QPair<const IconMask*, uint32>, AtlasFragment> IconFragments;
 base::flat_set<IconData*> iconData;
 
+// Masks colorized with overridden colors, shared by all icons.
+struct ColorizedKey {
+	qint64 mask = 0;
+	uint32 color = 0;
+
+	friend inline std::strong_ordering operator<=>(
+		const ColorizedKey &a,
+		const ColorizedKey &b) = default;
+	friend inline bool operator==(
+		const ColorizedKey &a,
+		const ColorizedKey &b) = default;
+};
+
+struct ColorizedImage {
+	QImage image;
+	std::list<ColorizedKey>::iterator position;
+};
+
+base::flat_map<ColorizedKey, ColorizedImage> ColorizedImages;
+std::list<ColorizedKey> ColorizedLru; // Most recent first.
+int64 ColorizedBytes = 0;
+
 [[nodiscard]] QImage CreateIconMask(
 		not_null<const IconMask*> mask,
 		int scale) {
@@ -63,6 +105,16 @@ base::flat_set<IconData*> iconData;
 [[nodiscard]] QImage ResolveIconMask(not_null<const IconMask*> mask) {
 	QMutexLocker lock(&IconMasksMutex);
 	if (const auto i = IconMasks.find(mask); i != end(IconMasks)) {
+		// Masks from the cache file are verified when they are first used.
+		const auto j = IconMasksUnchecked.find(mask);
+		if (j != end(IconMasksUnchecked)) {
+			const auto &image = i->second;
+			const auto check = XXH64(image.constBits(), image.sizeInBytes(), 0);
+			if (check != j->second) {
+				i->second = CreateIconMask(mask, Scale());
+			}
+			IconMasksUnchecked.erase(j);
+		}
 		return i->second;
 	}
 	return IconMasks.emplace(
@@ -71,6 +123,69 @@ base::flat_set<IconData*> iconData;
 	).first->second;
 }
 
+// Mask colorized with the color, for the given mask image or the shared one.
+[[nodiscard]] QPixmap ResolveIconPixmap(
+		not_null<const IconMask*> mask,
+		QColor color,
+		const QImage &maskImage = QImage()) {
+	const auto key = qMakePair(mask.get(), colorKey(color));
+	auto i = iconPixmaps.find(key);
+	if (i == end(iconPixmaps)) {
+		auto image = colorizeImage(
+			maskImage.isNull() ? ResolveIconMask(mask) : maskImage,
+			color);
+		image.setDevicePixelRatio(DevicePixelRatio());
+		i = iconPixmaps.emplace(
+			key,
+			QPixmap::fromImage(std::move(image))).first;
+	}
+	return i->second;
+}
+
+// Mask colorized with the color in the atlas, if it fits there.
+[[nodiscard]] AtlasFragment ResolveIconFragment(
+		not_null<const IconMask*> mask,
+		QColor color,
+		const QImage &maskImage) {
+	const auto key = qMakePair(mask.get(), colorKey(color));
+	if (const auto i = IconFragments.find(key); i != end(IconFragments)) {
+		return i->second;
+	} else if (!AtlasFits(maskImage.size())) {
+		return {};
+	}
+	const auto result = AtlasPlace(colorizeImage(maskImage, color));
+	IconFragments.emplace(key, result);
+	return result;
+}
+
+[[nodiscard]] QImage ResolveColorizedImage(
+		const QImage &mask,
+		QColor color) {
+	const auto key = ColorizedKey{ mask.cacheKey(), colorKey(color) };
+	if (const auto i = ColorizedImages.find(key); i != end(ColorizedImages)) {
+		ColorizedLru.splice(
+			begin(ColorizedLru),
+			ColorizedLru,
+			i->second.position);
+		return i->second.image;
+	}
+	auto image = QImage(mask.size(), QImage::Format_ARGB32_Premultiplied);
+	colorizeImage(mask, color, &image);
+	image.setDevicePixelRatio(DevicePixelRatio());
+
+	ColorizedLru.push_front(key);
+	ColorizedImages.emplace(key, ColorizedImage{ image, begin(ColorizedLru) });
+	ColorizedBytes += image.sizeInBytes();
+	while (ColorizedBytes > kColorizedCacheBudget
+		&& ColorizedLru.size() > 1) {
+		const auto i = ColorizedImages.find(ColorizedLru.back());
+		ColorizedBytes -= i->second.image.sizeInBytes();
+		ColorizedImages.erase(i);
+		ColorizedLru.pop_back();
+	}
+	return image;
+}
+
 QSize readGeneratedSize(const IconMask *mask, int scale) {
 	auto data = mask->data();
 	auto size = mask->size();
@@ -101,6 +216,296 @@ QSize readGeneratedSize(const IconMask *mask, int scale) {
 	return QSize();
 }
 
+// Masks decoded on startup in background, see prepareIconMasks().
+struct MasksPreparing {
+	std::vector<not_null<const IconMask*>> masks;
+	std::vector<uint64> hashes;
+	std::vector<QImage> images;
+	QString folder;
+	QString path;
+	int generation = 0;
+	int scale = 0;
+	int ratio = 0;
+	uint64 key = 0;
+	std::atomic<int> next = 0;
+	std::atomic<int> left = 0;
+};
+
+[[nodiscard]] QString IconMasksCacheFolder() {
+	if (!Ui::Integration::Exists()) {
+		return QString();
+	}
+	const auto base = Ui::Integration::Instance().emojiCacheFolder();
+	return base.isEmpty() ? QString() : (base + "/icons");
+}
+
+[[nodiscard]] QString IconMasksCachePrefix(const MasksPreparing &preparing) {
+	return "masks_"
+		+ QString::number(preparing.scale)
+		+ '_'
+		+ QString::number(preparing.ratio)
+		+ '_';
+}
+
+[[nodiscard]] qint64 IconMasksIndexSize(int count) {
+	return kIconMasksHeaderSize
+		+ qint64(count) * kIconMasksEntrySize
+		+ qint64(sizeof(uint64));
+}
+
+[[nodiscard]] QImage FindIconMask(not_null<const IconMask*> mask) {
+	QMutexLocker lock(&IconMasksMutex);
+	const auto i = IconMasks.find(mask);
+	return (i != end(IconMasks)) ? i->second : QImage();
+}
+
+void RememberIconMask(
+		const MasksPreparing &preparing,
+		int index,
+		const QImage &image) {
+	QMutexLocker lock(&IconMasksMutex);
+	if (IconMasksGeneration == preparing.generation) {
+		IconMasks.emplace(preparing.masks[index].get(), image);
+	}
+}
+
+// Files of the same scale and ratio that are still mapped are left
+// until the next time.
+void RemoveOtherIconMasksCaches(const MasksPreparing &preparing) {
+	const auto prefix = IconMasksCachePrefix(preparing);
+	const auto name = QFileInfo(preparing.path).fileName();
+	auto folder = QDir(preparing.folder);
+	for (const auto &other : folder.entryList({ prefix + '*' }, QDir::Files)) {
+		if (other != name) {
+			folder.remove(other);
+		}
+	}
+}
+
+// The file starts with an index: a header with the version, scale,
+// device pixel ratio, masks count and a key of all the masks contents,
+// then an entry for each mask with its contents hash, size, stride,
+// format, pixels offset and pixels checksum, then the XXH64 of the index.
+// The pixels of all the masks follow the index.
+void SaveIconMasksCache(const MasksPreparing &preparing) {
+	if (preparing.path.isEmpty()) {
+		return;
+	}
+	{
+		QMutexLocker lock(&IconMasksMutex);
+		if (IconMasksGeneration != preparing.generation) {
+			return;
+		}
+	}
+	const auto count = int(preparing.masks.size());
+	auto index = std::vector<uint32>{
+		uint32(kIconMasksCacheVersion),
+		uint32(preparing.scale),
+		uint32(preparing.ratio),
+		uint32(count),
+		uint32(preparing.key & 0xFFFFFFFFULL),
+		uint32(preparing.key >> 32),
+	};
+	auto offset = IconMasksIndexSize(count);
+	for (auto i = 0; i != count; ++i) {
+		const auto &image = preparing.images[i];
+		const auto check = uint64(
+			XXH64(image.constBits(), image.sizeInBytes(), 0));
+		index.insert(end(index), {
+			uint32(preparing.hashes[i] & 0xFFFFFFFFULL),
+			uint32(preparing.hashes[i] >> 32),
+			uint32(image.width()),
+			uint32(image.height()),
+			uint32(image.bytesPerLine()),
+			uint32(image.format()),
+			uint32(offset),
+			uint32(check & 0xFFFFFFFFULL),
+			uint32(check >> 32),
+		});
+		offset += image.sizeInBytes();
+	}
+	auto data = QByteArray();
+	data.reserve(offset);
+	data.append(
+		reinterpret_cast<const char*>(index.data()),
+		index.size() * sizeof(uint32));
+	const auto checksum = uint64(XXH64(data.constData(), data.size(), 0));
+	data.append(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+	for (const auto &image : preparing.images) {
+		data.append(
+			reinterpret_cast<const char*>(image.constBits()),
+			image.sizeInBytes());
+	}
+
+	// A file that is mapped by LoadIconMasksCache can't be replaced on
+	// Windows, so each set of masks is written to its own file, named by
+	// the key, and the files of other sets are removed after that.
+	QSaveFile f(preparing.path);
+	if (!f.open(QIODevice::WriteOnly)) {
+		if (!QDir::current().mkpath(preparing.folder)
+			|| !f.open(QIODevice::WriteOnly)) {
+			LOG(("App Error: Could not open icons cache '%1'."
+				).arg(preparing.path));
+			return;
+		}
+	}
+	if (f.write(data) != data.size() || !f.commit()) {
+		LOG(("App Error: Could not write icons cache '%1'."
+			).arg(preparing.path));
+		return;
+	}
+	RemoveOtherIconMasksCaches(preparing);
+}
+
+// Only the index is verified here, so that the pixels are not paged in
+// on startup. Each mask is verified by ResolveIconMask when first used.
+[[nodiscard]] bool LoadIconMasksCache(const MasksPreparing &preparing) {
+	if (preparing.path.isEmpty()) {
+		return false;
+	}
+	const auto count = int(preparing.masks.size());
+	const auto indexSize = IconMasksIndexSize(count);
+	const auto file = std::make_shared<QFile>(preparing.path);
+	const auto size = file->size();
+	if (size < indexSize || !file->open(QIODevice::ReadOnly)) {
+		return false;
+	}
+	const auto data = file->map(0, size);
+	if (!data) {
+		return false;
+	}
+	const auto body = indexSize - qint64(sizeof(uint64));
+	auto checksum = uint64();
+	memcpy(&checksum, data + body, sizeof(checksum));
+	if (XXH64(data, body, 0) != checksum) {
+		return false;
+	}
+	uint32 header[6] = { 0 };
+	memcpy(header, data, sizeof(header));
+	if (header[0] != uint32(kIconMasksCacheVersion)
+		|| header[1] != uint32(preparing.scale)
+		|| header[2] != uint32(preparing.ratio)
+		|| header[3] != uint32(count)
+		|| header[4] != uint32(preparing.key & 0xFFFFFFFFULL)
+		|| header[5] != uint32(preparing.key >> 32)) {
+		return false;
+	}
+
+	// The images wrap the read-only mapped pages directly. The file is
+	// closed and unmapped when the last of the images is destroyed.
+	//
+	// They keep the device pixel ratio of 1, because changing it detaches
+	// and copies the pixels. The ratio is set on the colorized results.
+	struct Loaded {
+		QImage image;
+		uint64 check = 0;
+	};
+	auto loaded = base::flat_map<uint64, Loaded>();
+	for (auto i = 0; i != count; ++i) {
+		uint32 entry[9] = { 0 };
+		memcpy(
+			entry,
+			data + kIconMasksHeaderSize + i * kIconMasksEntrySize,
+			sizeof(entry));
+		const auto width = int(entry[2]);
+		const auto height = int(entry[3]);
+		const auto stride = int(entry[4]);
+		const auto format = QImage::Format(entry[5]);
+		const auto offset = qint64(entry[6]);
+		if (format <= QImage::Format_Invalid
+			|| format >= QImage::NImageFormats
+			|| width <= 0
+			|| height <= 0
+			|| stride * 8
+				< width * QImage::toPixelFormat(format).bitsPerPixel()
+			|| offset < indexSize
+			|| offset + qint64(stride) * height > size) {
+			return false;
+		}
+		const auto release = [](void *file) {
+			delete static_cast<std::shared_ptr<QFile>*>(file);
+		};
+		const auto bits = static_cast<const uchar*>(data + offset);
+		auto image = QImage(
+			bits,
+			width,
+			height,
+			stride,
+			format,
+			release,
+			new std::shared_ptr<QFile>(file));
+		loaded.emplace(uint64(entry[0]) | (uint64(entry[1]) << 32), Loaded{
+			.image = std::move(image),
+			.check = uint64(entry[7]) | (uint64(entry[8]) << 32),
+		});
+	}
+	for (const auto hash : preparing.hashes) {
+		if (!loaded.contains(hash)) {
+			return false;
+		}
+	}
+	QMutexLocker lock(&IconMasksMutex);
+	if (IconMasksGeneration != preparing.generation) {
+		return true;
+	}
+	for (auto i = 0; i != count; ++i) {
+		const auto mask = preparing.masks[i].get();
+		const auto &entry = loaded[preparing.hashes[i]];
+		if (IconMasks.emplace(mask, entry.image).second) {
+			IconMasksUnchecked.emplace(mask, entry.check);
+		}
+	}
+	return true;
+}
+
+void DecodeIconMasks(const std::shared_ptr<MasksPreparing> &preparing) {
+	const auto count = int(preparing->masks.size());
+	while (true) {
+		const auto index = preparing->next++;
+		if (index >= count) {
+			return;
+		}
+		const auto mask = preparing->masks[index];
+		auto image = FindIconMask(mask);
+		if (image.isNull()) {
+			image = CreateIconMask(mask, preparing->scale);
+			RememberIconMask(*preparing, index, image);
+		}
+		preparing->images[index] = std::move(image);
+		if (--preparing->left == 0) {
+			SaveIconMasksCache(*preparing);
+		}
+	}
+}
+
+void PrepareIconMasks(const std::shared_ptr<MasksPreparing> &preparing) {
+	const auto count = int(preparing->masks.size());
+	preparing->hashes.reserve(count);
+	for (const auto mask : preparing->masks) {
+		preparing->hashes.push_back(XXH64(mask->data(), mask->size(), 0));
+	}
+	auto sorted = preparing->hashes;
+	ranges::sort(sorted);
+	preparing->key = XXH64(sorted.data(), sorted.size() * sizeof(uint64), 0);
+	if (!preparing->folder.isEmpty()) {
+		preparing->path = preparing->folder
+			+ '/'
+			+ IconMasksCachePrefix(*preparing)
+			+ QString::number(preparing->key, 16);
+	}
+	if (LoadIconMasksCache(*preparing)) {
+		return;
+	}
+
+	// This job decodes as well, so it doesn't wait for the helpers.
+	const auto threads = int(std::thread::hardware_concurrency());
+	const auto helpers = std::min(count, std::max(threads, 1)) - 1;
+	for (auto i = 0; i != helpers; ++i) {
+		crl::async([=] { DecodeIconMasks(preparing); });
+	}
+	DecodeIconMasks(preparing);
+}
+
 } // namespace
 
 MonoIcon::MonoIcon(const MonoIcon &other, const style::palette &palette)
@@ -118,10 +523,19 @@ MonoIcon::MonoIcon(const IconMask *mask, Color color, QPoint offset)
 }
 
 void MonoIcon::reset() const {
+	_fragment = AtlasFragment();
 	_pixmap = QPixmap();
 	_size = QSize();
 }
 
+void MonoIcon::reset(const base::flat_set<int> &colors) const {
+	// Icons with palette overrides don't have an index in the main one.
+	const auto index = style::main_palette::indexOfColor(_color);
+	if (index < 0 || colors.contains(index)) {
+		reset();
+	}
+}
+
 int MonoIcon::width() const {
 	ensureLoaded();
 	return _size.width();
@@ -141,6 +555,10 @@ QPoint MonoIcon::offset() const {
 	return _offset;
 }
 
+const IconMask *MonoIcon::mask() const {
+	return _mask;
+}
+
 void MonoIcon::paint(QPainter &p, const QPoint &pos, int outerw) const {
 	int w = width(), h = height();
 	QPoint fullOffset = pos + offset();
@@ -148,7 +566,19 @@ void MonoIcon::paint(QPainter &p, const QPoint &pos, int outerw) const {
 	int partPosY = fullOffset.y();
 
 	ensureLoaded();
-	if (_pixmap.isNull()) {
+	if (_fragment) {
+		// Fragments are drawn in their exact device size, like _pixmap.
+		const auto ratio = qreal(DevicePixelRatio());
+		const auto &rect = _fragment.rect;
+		p.drawPixmap(
+			QRectF(
+				partPosX,
+				partPosY,
+				rect.width() / ratio,
+				rect.height() / ratio),
+			AtlasPixmap(_fragment.page),
+			QRectF(rect));
+	} else if (_pixmap.isNull()) {
 		p.fillRect(partPosX, partPosY, w, h, _color);
 	} else {
 		p.drawPixmap(partPosX, partPosY, _pixmap);
@@ -157,7 +587,9 @@ void MonoIcon::paint(QPainter &p, const QPoint &pos, int outerw) const {
 
 void MonoIcon::fill(QPainter &p, const QRect &rect) const {
 	ensureLoaded();
-	if (_pixmap.isNull()) {
+	if (_fragment) {
+		p.drawPixmap(rect, AtlasPixmap(_fragment.page), _fragment.rect);
+	} else if (_pixmap.isNull()) {
 		p.fillRect(rect, _color);
 	} else {
 		p.drawPixmap(rect, _pixmap, QRect(0, 0, _pixmap.width(), _pixmap.height()));
@@ -171,7 +603,7 @@ void MonoIcon::paint(QPainter &p, const QPoint &pos, int outerw, QColor colorOve
 	int partPosY = fullOffset.y();
 
 	ensureLoaded();
-	if (_pixmap.isNull()) {
+	if (_maskImage.isNull()) {
 		p.fillRect(partPosX, partPosY, w, h, colorOverride);
 	} else {
 		ensureColorizedImage(colorOverride);
@@ -181,7 +613,7 @@ void MonoIcon::paint(QPainter &p, const QPoint &pos, int outerw, QColor colorOve
 
 void MonoIcon::fill(QPainter &p, const QRect &rect, QColor colorOverride) const {
 	ensureLoaded();
-	if (_pixmap.isNull()) {
+	if (_maskImage.isNull()) {
 		p.fillRect(rect, colorOverride);
 	} else {
 		ensureColorizedImage(colorOverride);
@@ -195,10 +627,10 @@ void MonoIcon::paint(
 		int outerw,
 		const style::palette &paletteOverride) const {
 	auto size = readGeneratedSize(_mask, Scale());
-	auto maskImage = QImage();
+	auto pixmap = QPixmap();
 	if (size.isEmpty()) {
-		maskImage = CreateIconMask(_mask, Scale());
-		size = maskImage.size() / DevicePixelRatio();
+		pixmap = ResolveIconPixmap(_mask, _color[paletteOverride]->c);
+		size = pixmap.size() / DevicePixelRatio();
 	}
 
 	const auto w = size.width();
@@ -207,12 +639,8 @@ void MonoIcon::paint(
 	const auto partPosX = RightToLeft() ? (outerw - fullOffset.x() - w) : fullOffset.x();
 	const auto partPosY = fullOffset.y();
 
-	if (!maskImage.isNull()) {
-		auto colorizedImage = QImage(
-			maskImage.size(),
-			QImage::Format_ARGB32_Premultiplied);
-		colorizeImage(maskImage, _color[paletteOverride]->c, &colorizedImage);
-		p.drawImage(partPosX, partPosY, colorizedImage);
+	if (!pixmap.isNull()) {
+		p.drawPixmap(partPosX, partPosY, pixmap);
 	} else {
 		p.fillRect(partPosX, partPosY, w, h, _color[paletteOverride]);
 	}
@@ -222,32 +650,43 @@ void MonoIcon::fill(
 		QPainter &p,
 		const QRect &rect,
 		const style::palette &paletteOverride) const {
-	auto size = readGeneratedSize(_mask, Scale());
-	auto maskImage = QImage();
+	const auto size = readGeneratedSize(_mask, Scale());
 	if (size.isEmpty()) {
-		maskImage = CreateIconMask(_mask, Scale());
-		size = maskImage.size() / DevicePixelRatio();
-	}
-	if (!maskImage.isNull()) {
-		auto colorizedImage = QImage(
-			maskImage.size(),
-			QImage::Format_ARGB32_Premultiplied);
-		colorizeImage(maskImage, _color[paletteOverride]->c, &colorizedImage);
-		p.drawImage(rect, colorizedImage, colorizedImage.rect());
+		const auto pixmap = ResolveIconPixmap(
+			_mask,
+			_color[paletteOverride]->c);
+		p.drawPixmap(rect, pixmap, pixmap.rect());
 	} else {
 		p.fillRect(rect, _color[paletteOverride]);
 	}
 }
 
+void MonoIcon::paint(
+		IconBatch &batch,
+		const QPoint &pos,
+		int outerw) const {
+	ensureLoaded();
+	if (!_fragment) {
+		paint(batch.painter(), pos, outerw);
+		return;
+	}
+	const auto fullOffset = pos + offset();
+	const auto partPosX = RightToLeft()
+		? (outerw - fullOffset.x() - _size.width())
+		: fullOffset.x();
+	batch.add(_fragment, QPoint(partPosX, fullOffset.y()));
+}
+
 QImage MonoIcon::instance(QColor colorOverride, int scale) const {
 	if (scale == kScaleAuto) {
 		ensureLoaded();
 		auto result = QImage(size() * DevicePixelRatio(), QImage::Format_ARGB32_Premultiplied);
 		result.setDevicePixelRatio(DevicePixelRatio());
-		if (_pixmap.isNull()) {
+		if (_maskImage.isNull()) {
 			result.fill(colorOverride);
 		} else {
 			colorizeImage(_maskImage, colorOverride, &result);
+			result.setDevicePixelRatio(DevicePixelRatio());
 		}
 		return result;
 	}
@@ -281,24 +720,21 @@ void MonoIcon::ensureLoaded() const {
 }
 
 void MonoIcon::ensureColorizedImage(QColor color) const {
-	if (_colorizedImage.isNull()) {
-		_colorizedImage = QImage(
-			_maskImage.size(),
-			QImage::Format_ARGB32_Premultiplied);
+	const auto key = colorKey(color);
+	if (!_colorizedImage.isNull() && _colorizedKey == key) {
+		return;
 	}
-	colorizeImage(_maskImage, color, &_colorizedImage);
+	_colorizedImage = ResolveColorizedImage(_maskImage, color);
+	_colorizedKey = key;
 }
 
 void MonoIcon::createCachedPixmap() const {
-	auto key = qMakePair(_mask, colorKey(_color->c));
-	auto j = iconPixmaps.find(key);
-	if (j == end(iconPixmaps)) {
-		auto image = colorizeImage(_maskImage, _color);
-		j = iconPixmaps.emplace(
-			key,
-			QPixmap::fromImage(std::move(image))).first;
+	_fragment = ResolveIconFragment(_mask, _color->c, _maskImage);
+	if (_fragment) {
+		_size = _fragment.rect.size() / DevicePixelRatio();
+		return;
 	}
-	_pixmap = j->second;
+	_pixmap = ResolveIconPixmap(_mask, _color->c, _maskImage);
 	_size = _pixmap.size() / DevicePixelRatio();
 }
 
@@ -379,17 +815,105 @@ Icon Icon::withPalette(const style::palette &palette) const {
 
 void resetIcons() {
 	iconPixmaps.clear();
+	IconFragments.clear();
+	AtlasClear();
 	for (const auto data : iconData) {
 		data->reset();
 	}
 }
 
+// Colorized pixmaps are cached by color values, so after a partial
+// palette change only pixmaps of colors that left the palette are dropped.
+void resetIcons(const base::flat_set<int> &colors) {
+	if (colors.empty()) {
+		return;
+	}
+	const auto saved = style::main_palette::save();
+	const auto values = reinterpret_cast<const uchar*>(saved.constData());
+	auto used = std::vector<uint32>();
+	used.reserve(saved.size() / 4);
+	for (auto i = 0; i + 4 <= saved.size(); i += 4) {
+		used.push_back((uint32(values[i]) << 24)
+			| (uint32(values[i + 1]) << 16)
+			| (uint32(values[i + 2]) << 8)
+			| uint32(values[i + 3]));
+	}
+	ranges::sort(used);
+	const auto stale = [&](const QPair<const IconMask*, uint32> &key) {
+		return !ranges::binary_search(used, key.second);
+	};
+	for (auto i = begin(iconPixmaps); i != end(iconPixmaps);) {
+		if (stale(i->first)) {
+			i = iconPixmaps.erase(i);
+		} else {
+			++i;
+		}
+	}
+	auto fragmented = false;
+	for (auto i = begin(IconFragments); i != end(IconFragments);) {
+		if (stale(i->first)) {
+			if (AtlasRelease(i->second)) {
+				fragmented = true;
+			}
+			i = IconFragments.erase(i);
+		} else {
+			++i;
+		}
+	}
+	if (fragmented) {
+		resetIcons();
+		return;
+	}
+	for (const auto data : iconData) {
+		data->reset(colors);
+	}
+}
+
+void prepareIconMasks() {
+	const auto scale = Scale();
+	auto masks = base::flat_set<const IconMask*>();
+	for (const auto data : iconData) {
+		for (const auto &part : data->parts()) {
+			const auto mask = part.mask();
+			if (mask && readGeneratedSize(mask, scale).isEmpty()) {
+				masks.emplace(mask);
+			}
+		}
+	}
+	const auto count = int(masks.size());
+	if (!count) {
+		return;
+	}
+
+	// The cache has all the masks, even the ones already resolved, so that
+	// its key doesn't depend on what was painted before this call.
+	const auto preparing = std::make_shared<MasksPreparing>();
+	preparing->masks.assign(begin(masks), end(masks));
+	{
+		QMutexLocker lock(&IconMasksMutex);
+		preparing->generation = IconMasksGeneration;
+	}
+	preparing->images.resize(count);
+	preparing->left = count;
+	preparing->scale = scale;
+	preparing->ratio = DevicePixelRatio();
+	preparing->folder = IconMasksCacheFolder();
+	crl::async([=] { PrepareIconMasks(preparing); });
+}
+
 void destroyIcons() {
 	iconData.clear();
 	iconPixmaps.clear();
+	IconFragments.clear();
+	AtlasClear();
+	ColorizedImages.clear();
+	ColorizedLru.clear();
+	ColorizedBytes = 0;
 
 	QMutexLocker lock(&IconMasksMutex);
 	IconMasks.clear();
+	IconMasksUnchecked.clear();
+	++IconMasksGeneration;
 }
 
 } // namespace internal
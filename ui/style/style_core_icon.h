@@ -7,9 +7,11 @@
 #pragma once
 
 #include "ui/style/style_core_color.h"
+#include "ui/style/style_core_icon_atlas.h"
 #include "ui/style/style_core_scale.h"
 #include "base/algorithm.h"
 #include "base/assertion.h"
+#include "base/flat_set.h"
 
 #include <vector>
 
@@ -47,11 +49,13 @@ public:
 	MonoIcon(const IconMask *mask, Color color, QPoint offset);
 
 	void reset() const;
+	void reset(const base::flat_set<int> &colors) const;
 	int width() const;
 	int height() const;
 	QSize size() const;
 
 	QPoint offset() const;
+	const IconMask *mask() const;
 
 	void paint(QPainter &p, const QPoint &pos, int outerw) const;
 	void fill(QPainter &p, const QRect &rect) const;
@@ -62,6 +66,8 @@ public:
 	void paint(QPainter &p, const QPoint &pos, int outerw, const style::palette &paletteOverride) const;
 	void fill(QPainter &p, const QRect &rect, const style::palette &paletteOverride) const;
 
+	void paint(IconBatch &batch, const QPoint &pos, int outerw) const;
+
 	QImage instance(QColor colorOverride, int scale) const;
 
 	~MonoIcon() {
@@ -76,7 +82,9 @@ private:
 	Color _color;
 	QPoint _offset = { 0, 0 };
 	mutable QImage _maskImage, _colorizedImage;
-	mutable QPixmap _pixmap; // for pixmaps
+	mutable uint32 _colorizedKey = 0;
+	mutable AtlasFragment _fragment; // for icons in the atlas
+	mutable QPixmap _pixmap; // for pixmaps too large for the atlas
 	mutable QSize _size; // for rects
 
 };
@@ -98,9 +106,17 @@ public:
 			part.reset();
 		}
 	}
+	void reset(const base::flat_set<int> &colors) {
+		for (const auto &part : _parts) {
+			part.reset(colors);
+		}
+	}
 	bool empty() const {
 		return _parts.empty();
 	}
+	const std::vector<MonoIcon> &parts() const {
+		return _parts;
+	}
 
 	void paint(QPainter &p, const QPoint &pos, int outerw) const {
 		for (const auto &part : _parts) {
@@ -123,6 +139,12 @@ public:
 	}
 	void fill(QPainter &p, const QRect &rect, const style::palette &paletteOverride) const;
 
+	void paint(IconBatch &batch, const QPoint &pos, int outerw) const {
+		for (const auto &part : _parts) {
+			part.paint(batch, pos, outerw);
+		}
+	}
+
 	QImage instance(QColor colorOverride, int scale) const;
 
 	int width() const;
@@ -267,6 +289,7 @@ public:
 
 private:
 	friend class Proxy;
+	friend class style::IconBatch;
 
 	void paintWithPalette(QPainter &p, const QPoint &pos, int outerw, const style::palette &paletteOverride) const {
 		return _data->paint(p, pos, outerw, paletteOverride);
@@ -280,6 +303,9 @@ private:
 	void fillWithPalette(QPainter &p, const QRect &rect, const style::palette &paletteOverride) const {
 		return _data->fill(p, rect, paletteOverride);
 	}
+	void paint(IconBatch &batch, const QPoint &pos, int outerw) const {
+		return _data->paint(batch, pos, outerw);
+	}
 
 	IconData *_data = nullptr;
 	bool _owner = false;
@@ -287,6 +313,8 @@ private:
 };
 
 void resetIcons();
+void resetIcons(const base::flat_set<int> &colors);
+void prepareIconMasks();
 void destroyIcons();
 
 } // namespace internal
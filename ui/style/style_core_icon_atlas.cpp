@@ -0,0 +1,207 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#include "ui/style/style_core_icon_atlas.h"
+
+#include "ui/style/style_core_icon.h"
+#include "ui/style/style_core_scale.h"
+
+#include <optional>
+
+namespace style {
+namespace internal {
+namespace {
+
+constexpr auto kAtlasSize = 1024;
+constexpr auto kAtlasMaxSide = 128;
+constexpr auto kShelfSlack = 8;
+
+struct AtlasShelf {
+	int top = 0;
+	int height = 0;
+	int left = 0;
+};
+
+struct AtlasPage {
+	QPixmap pixmap;
+	std::vector<AtlasShelf> shelves;
+	int bottom = 0;
+};
+
+std::vector<AtlasPage> AtlasPages;
+int64 AtlasReleased = 0;
+
+[[nodiscard]] std::optional<QPoint> Allocate(AtlasPage &page, QSize size) {
+	for (auto &shelf : page.shelves) {
+		if (shelf.height >= size.height()
+			&& shelf.height <= size.height() + kShelfSlack
+			&& shelf.left + size.width() <= kAtlasSize) {
+			const auto result = QPoint(shelf.left, shelf.top);
+			shelf.left += size.width();
+			return result;
+		}
+	}
+	if (page.bottom + size.height() > kAtlasSize) {
+		return std::nullopt;
+	}
+	page.shelves.push_back({
+		.top = page.bottom,
+		.height = size.height(),
+		.left = size.width(),
+	});
+	const auto result = QPoint(0, page.bottom);
+	page.bottom += size.height();
+	return result;
+}
+
+// The image is surrounded by a copy of its edge pixels, so that scaling
+// it in MonoIcon::fill() doesn't take pixels of the neighbour icons.
+void Draw(QPixmap &pixmap, QPoint position, const QImage &image) {
+	const auto w = image.width();
+	const auto h = image.height();
+	const auto x = position.x() + 1;
+	const auto y = position.y() + 1;
+	auto p = QPainter(&pixmap);
+	p.setCompositionMode(QPainter::CompositionMode_Source);
+	const auto copy = [&](int left, int top, QRect source) {
+		p.drawImage(QRect(QPoint(left, top), source.size()), image, source);
+	};
+	copy(x, y, QRect(0, 0, w, h));
+	copy(x, y - 1, QRect(0, 0, w, 1));
+	copy(x, y + h, QRect(0, h - 1, w, 1));
+	copy(x - 1, y, QRect(0, 0, 1, h));
+	copy(x + w, y, QRect(w - 1, 0, 1, h));
+	copy(x - 1, y - 1, QRect(0, 0, 1, 1));
+	copy(x + w, y - 1, QRect(w - 1, 0, 1, 1));
+	copy(x - 1, y + h, QRect(0, h - 1, 1, 1));
+	copy(x + w, y + h, QRect(w - 1, h - 1, 1, 1));
+}
+
+} // namespace
+
+bool AtlasFits(QSize size) {
+	return !size.isEmpty()
+		&& (size.width() + 2 <= kAtlasMaxSide)
+		&& (size.height() + 2 <= kAtlasMaxSide);
+}
+
+AtlasFragment AtlasPlace(const QImage &image) {
+	if (!AtlasFits(image.size())) {
+		return {};
+	}
+	const auto size = image.size() + QSize(2, 2);
+	const auto place = [&](int index, QPoint position) {
+		Draw(AtlasPages[index].pixmap, position, image);
+		return AtlasFragment{
+			.page = index,
+			.rect = QRect(position + QPoint(1, 1), image.size()),
+		};
+	};
+	for (auto i = 0, count = int(AtlasPages.size()); i != count; ++i) {
+		if (const auto position = Allocate(AtlasPages[i], size)) {
+			return place(i, *position);
+		}
+	}
+	auto &page = AtlasPages.emplace_back();
+	page.pixmap = QPixmap(kAtlasSize, kAtlasSize);
+	page.pixmap.fill(Qt::transparent);
+	const auto position = Allocate(page, size);
+	Assert(position.has_value());
+	return place(int(AtlasPages.size()) - 1, *position);
+}
+
+const QPixmap &AtlasPixmap(int page) {
+	Expects(page >= 0 && page < int(AtlasPages.size()));
+
+	return AtlasPages[page].pixmap;
+}
+
+bool AtlasRelease(const AtlasFragment &fragment) {
+	if (!fragment) {
+		return false;
+	}
+	const auto &rect = fragment.rect;
+	AtlasReleased += int64(rect.width() + 2) * (rect.height() + 2);
+	const auto total = int64(AtlasPages.size()) * kAtlasSize * kAtlasSize;
+	return (AtlasReleased * 2 > total);
+}
+
+void AtlasClear() {
+	AtlasPages.clear();
+	AtlasReleased = 0;
+}
+
+} // namespace internal
+
+IconBatch::IconBatch(QPainter &p) : _p(p) {
+}
+
+IconBatch::~IconBatch() {
+	flush();
+}
+
+void IconBatch::paint(
+		const internal::Icon &icon,
+		const QPoint &pos,
+		int outerw) {
+	icon.paint(*this, pos, outerw);
+}
+
+void IconBatch::paint(
+		const internal::Icon &icon,
+		int x,
+		int y,
+		int outerw) {
+	icon.paint(*this, QPoint(x, y), outerw);
+}
+
+void IconBatch::paintInCenter(
+		const internal::Icon &icon,
+		const QRect &outer) {
+	icon.paint(
+		*this,
+		QPoint(
+			outer.x() + (outer.width() - icon.width()) / 2,
+			outer.y() + (outer.height() - icon.height()) / 2),
+		outer.x() * 2 + outer.width());
+}
+
+void IconBatch::flush() {
+	if (!_fragments.empty()) {
+		_p.drawPixmapFragments(
+			_fragments.data(),
+			int(_fragments.size()),
+			internal::AtlasPixmap(_page));
+		_fragments.clear();
+	}
+	_page = -1;
+}
+
+QPainter &IconBatch::painter() {
+	flush();
+	return _p;
+}
+
+void IconBatch::add(
+		const internal::AtlasFragment &fragment,
+		QPoint position) {
+	if (_page != fragment.page) {
+		flush();
+		_page = fragment.page;
+	}
+	// Fragments are placed by their centers, the source rect is scaled
+	// from the device pixels of the atlas to the logical pixels.
+	const auto scale = 1. / DevicePixelRatio();
+	const auto &rect = fragment.rect;
+	const auto half = QPointF(rect.width(), rect.height()) * (scale / 2.);
+	_fragments.push_back(QPainter::PixmapFragment::create(
+		QPointF(position) + half,
+		QRectF(rect),
+		scale,
+		scale));
+}
+
+} // namespace style
@@ -0,0 +1,72 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#pragma once
+
+#include <QtGui/QPainter>
+#include <QtGui/QPixmap>
+
+#include <vector>
+
+namespace style {
+namespace internal {
+
+// Place of a colorized icon inside one of the shared atlas pixmaps,
+// the rect is in device pixels.
+struct AtlasFragment {
+	int page = -1;
+	QRect rect;
+
+	explicit operator bool() const {
+		return (page >= 0);
+	}
+};
+
+[[nodiscard]] bool AtlasFits(QSize size);
+[[nodiscard]] AtlasFragment AtlasPlace(const QImage &image);
+[[nodiscard]] const QPixmap &AtlasPixmap(int page);
+
+// Space of released fragments is not reused, returns true when enough of it
+// was released so that the pages should be cleared and filled again.
+[[nodiscard]] bool AtlasRelease(const AtlasFragment &fragment);
+void AtlasClear();
+
+class MonoIcon;
+class Icon;
+
+} // namespace internal
+
+// Collects icons painted with the atlas and draws them with a single
+// drawPixmapFragments() call for each run of icons from the same page.
+// Icons that are not in the atlas are painted right away, after the
+// already collected ones, so the painting order is kept.
+class IconBatch final {
+public:
+	explicit IconBatch(QPainter &p);
+	IconBatch(const IconBatch &other) = delete;
+	IconBatch &operator=(const IconBatch &other) = delete;
+	~IconBatch();
+
+	void paint(const internal::Icon &icon, const QPoint &pos, int outerw);
+	void paint(const internal::Icon &icon, int x, int y, int outerw);
+	void paintInCenter(const internal::Icon &icon, const QRect &outer);
+
+	void flush();
+
+private:
+	friend class internal::MonoIcon;
+
+	// Draws the collected icons, so that the painter can be used directly.
+	[[nodiscard]] QPainter &painter();
+	void add(const internal::AtlasFragment &fragment, QPoint position);
+
+	QPainter &_p;
+	std::vector<QPainter::PixmapFragment> _fragments;
+	int _page = -1;
+
+};
+
+} // namespace style
@@ -214,10 +214,78 @@ auto palette::PrepareFinalizeHelper(const colorizer &with)
 namespace main_palette {
 namespace {
 
+// PaletteVersion() of the notification that brings each color change.
+std::vector<int> ColorVersions;
+int AllColorsVersion = 0;
+
+// Changes not yet applied to the icons, see internal::ApplyPaletteChanges.
+base::flat_set<int> ChangedColors;
+bool AllColorsChanged = false;
+
 palette &GetMutable() {
 	return const_cast<palette&>(*get());
 }
 
+// Saving a palette finalizes it, so palettes that are still being
+// filled are not saved and count as changed entirely.
+[[nodiscard]] QByteArray Snapshot() {
+	const auto current = get();
+	return current->ready() ? current->save() : QByteArray();
+}
+
+void MarkChanged(int index) {
+	if (int(ColorVersions.size()) <= index) {
+		ColorVersions.resize(index + 1);
+	}
+	ColorVersions[index] = PaletteVersion() + 1;
+	if (!AllColorsChanged) {
+		ChangedColors.emplace(index);
+	}
+}
+
+void MarkAllChanged() {
+	AllColorsVersion = PaletteVersion() + 1;
+	AllColorsChanged = true;
+	ChangedColors.clear();
+}
+
+// Whole palette changes reset the icons right away, as they always did.
+void Changed(const QByteArray &was) {
+	const auto now = Snapshot();
+	if (now.isEmpty() || was.size() != now.size()) {
+		MarkAllChanged();
+	} else {
+		const auto count = int(now.size() / 4);
+		for (auto i = 0; i != count; ++i) {
+			const auto offset = i * 4;
+			if (memcmp(was.constData() + offset, now.constData() + offset, 4)) {
+				MarkChanged(i);
+			}
+		}
+	}
+	internal::ApplyPaletteChanges();
+}
+
+// Single colors are compared in place, the icons are reset only
+// when the change is notified with NotifyPaletteChanged(). Colors of
+// a palette that is not ready can't be compared, see Snapshot().
+template <typename Method>
+palette::SetResult SetColor(QLatin1String name, Method &&method) {
+	const auto index = internal::GetPaletteIndex(name);
+	const auto current = get();
+	const auto tracked = (index >= 0) && current->ready();
+	const auto was = tracked ? current->colorAtIndex(index)->c : QColor();
+	const auto result = method(GetMutable());
+	if (!tracked) {
+		if (index >= 0) {
+			MarkAllChanged();
+		}
+	} else if (current->colorAtIndex(index)->c != was) {
+		MarkChanged(index);
+	}
+	return result;
+}
+
 } // namespace
 
 QByteArray save() {
@@ -225,39 +293,74 @@ QByteArray save() {
 }
 
 bool load(const QByteArray &cache) {
+	const auto was = Snapshot();
 	if (GetMutable().load(cache)) {
-		style::internal::resetIcons();
+		Changed(was);
 		return true;
 	}
 	return false;
 }
 
 palette::SetResult setColor(QLatin1String name, uchar r, uchar g, uchar b, uchar a) {
-	return GetMutable().setColor(name, r, g, b, a);
+	return SetColor(name, [&](palette &that) {
+		return that.setColor(name, r, g, b, a);
+	});
 }
 
 palette::SetResult setColor(QLatin1String name, QLatin1String from) {
-	return GetMutable().setColor(name, from);
+	return SetColor(name, [&](palette &that) {
+		return that.setColor(name, from);
+	});
 }
 
 void apply(const palette &other) {
+	const auto was = Snapshot();
 	GetMutable() = other;
-	style::internal::resetIcons();
+	Changed(was);
 }
 
 void reset() {
+	const auto was = Snapshot();
 	GetMutable().reset();
-	style::internal::resetIcons();
+	Changed(was);
 }
 
 void reset(const colorizer &with) {
+	const auto was = Snapshot();
 	GetMutable().reset(with);
-	style::internal::resetIcons();
+	Changed(was);
 }
 
 int indexOfColor(color c) {
 	return GetMutable().indexOfColor(c);
 }
 
+int colorVersion(color c) {
+	const auto index = indexOfColor(c);
+	if (index < 0) {
+		return PaletteVersion();
+	} else if (index >= int(ColorVersions.size())) {
+		return AllColorsVersion;
+	}
+	return std::max(ColorVersions[index], AllColorsVersion);
+}
+
 } // namespace main_palette
+
+namespace internal {
+
+void ApplyPaletteChanges() {
+	if (base::take(main_palette::AllColorsChanged)) {
+		resetIcons();
+	} else if (!main_palette::ChangedColors.empty()) {
+		resetIcons(base::take(main_palette::ChangedColors));
+	}
+}
+
+} // namespace internal
+
+bool PaletteColorChanged(const color &c, int sinceVersion) {
+	return (main_palette::colorVersion(c) > sinceVersion);
+}
+
 } // namespace style
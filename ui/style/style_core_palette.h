@@ -42,6 +42,10 @@ public:
 	int indexOfColor(color c) const;
 	color colorAtIndex(int index) const;
 
+	[[nodiscard]] bool ready() const {
+		return _ready;
+	}
+
 private:
 	struct FinalizeHelper;
 	struct TempColorData { uchar r, g, b, a; };
@@ -71,5 +75,9 @@ void reset();
 void reset(const colorizer &with);
 int indexOfColor(color c);
 
+// PaletteVersion() after the notification about the last change of the
+// color, the current one for colors not from the main palette.
+[[nodiscard]] int colorVersion(color c);
+
 } // namespace main_palette
 } // namespace style
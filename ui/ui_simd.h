@@ -0,0 +1,72 @@
+// This file is part of Desktop App Toolkit,
+// a set of libraries for developing nice desktop applications.
+//
+// For license and copyright information please follow this link:
+// https://github.com/desktop-app/legal/blob/master/LEGAL
+//
+#pragma once
+
+// Instruction sets available at compile time for the vectorized kernels,
+// each kernel should have a scalar loop for the rest of the pixels.
+//
+// On x86-64 without -mavx2 the AVX2 kernels are still built with
+// UI_SIMD_AVX2_TARGET if UI_SIMD_AVX2_DISPATCH is defined, and they are
+// called only if Ui::SimdHasAvx2() says the CPU supports them. Lambdas
+// in such kernels don't get the target, so they use functions instead.
+
+#if defined __AVX2__
+#include <immintrin.h>
+#define UI_SIMD_AVX2
+#define UI_SIMD_AVX2_DISPATCH
+#define UI_SIMD_AVX2_TARGET
+#elif defined __x86_64__ && (defined __GNUC__ || defined __clang__)
+#include <immintrin.h>
+#define UI_SIMD_AVX2_DISPATCH
+#define UI_SIMD_AVX2_TARGET __attribute__((target("avx2")))
+#elif defined _M_X64 && defined _MSC_VER
+#include <immintrin.h>
+#include <intrin.h>
+#define UI_SIMD_AVX2_DISPATCH
+#define UI_SIMD_AVX2_TARGET
+#endif // __AVX2__ || __x86_64__ || _M_X64
+
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UI_SIMD_SSE2
+#elif defined __ARM_NEON || defined _M_ARM64
+#include <arm_neon.h>
+#define UI_SIMD_NEON
+#endif // __SSE2__ || __ARM_NEON
+
+namespace Ui {
+
+[[nodiscard]] inline bool SimdHasAvx2() {
+#if defined UI_SIMD_AVX2
+	return true;
+#elif defined UI_SIMD_AVX2_DISPATCH && defined _MSC_VER
+	static const auto result = [] {
+		int info[4] = { 0 };
+		__cpuid(info, 0);
+		if (info[0] < 7) {
+			return false;
+		}
+		__cpuid(info, 1);
+		constexpr auto kOsxsave = 1 << 27;
+		constexpr auto kAvx = 1 << 28;
+		if ((info[2] & (kOsxsave | kAvx)) != (kOsxsave | kAvx)
+			|| (_xgetbv(0) & 0x06) != 0x06) {
+			return false;
+		}
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+	}();
+	return result;
+#elif defined UI_SIMD_AVX2_DISPATCH
+	static const auto result = (__builtin_cpu_supports("avx2") != 0);
+	return result;
+#else // UI_SIMD_AVX2 || UI_SIMD_AVX2_DISPATCH
+	return false;
+#endif // UI_SIMD_AVX2 || UI_SIMD_AVX2_DISPATCH
+}
+
+} // namespace Ui
@@ -95,11 +95,17 @@ void RippleButton::setForceRippled(
 	if (_forceRippled != rippled) {
 		_forceRippled = rippled;
 		if (_forceRippled) {
+			_forceRippledVersion = style::PaletteVersion();
 			_forceRippledSubscription = style::PaletteChanged(
 			) | rpl::filter([=] {
-				return _ripple != nullptr;
+				// Only the ripple cache painted with _st.color is dropped.
+				return (_ripple != nullptr)
+					&& style::PaletteColorChanged(
+						_st.color,
+						_forceRippledVersion);
 			}) | rpl::start_with_next([=] {
 				_ripple->forceRepaint();
+				_forceRippledVersion = style::PaletteVersion();
 			});
 			ensureRipple();
 			if (_ripple->empty()) {
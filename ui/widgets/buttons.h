@@ -87,6 +87,7 @@ private:
 	const style::RippleAnimation &_st;
 	std::unique_ptr<RippleAnimation> _ripple;
 	bool _forceRippled = false;
+	int _forceRippledVersion = 0;
 	rpl::lifetime _forceRippledSubscription;
 
 };